@@ -76,8 +76,8 @@ all: clean $(SRCS) build pc_side size
 
 build: $(TARGET).elf $(TARGET).bin $(TARGET).lst
 
-pc_side: pc_side/pc_server.c pc_side/pc_request.c pc_side/pc_mm.c pc_side/pc_mlib.c pc_side/dict.c pc_side/dict.h pc_side/memlib.h pc_side/pc_mm.h pc_side/pc_request.h pc_side/uart_comms.h shared_side/shared_config.h
-	gcc -g3 -o pc_server pc_side/pc_server.c pc_side/pc_request.c pc_side/pc_mm.c pc_side/pc_mlib.c pc_side/dict.c
+pc_side: pc_side/pc_server.c pc_side/pc_request.c pc_side/pc_mm.c pc_side/pc_mlib.c pc_side/dict.c pc_side/pc_magazine.c pc_side/dict.h pc_side/memlib.h pc_side/pc_mm.h pc_side/pc_request.h pc_side/pc_magazine.h pc_side/uart_comms.h shared_side/shared_config.h shared_side/req_codec.c shared_side/req_codec.h shared_side/link_frame.c shared_side/link_frame.h pc_side/pc_transport.c pc_side/pc_transport.h pc_side/pc_event.c pc_side/pc_event.h pc_side/pc_latency.c pc_side/pc_latency.h pc_side/pc_capture.c pc_side/pc_capture.h pc_side/pc_heap.h pc_side/pc_ring.c pc_side/pc_ring.h pc_side/pc_shadow.c pc_side/pc_shadow.h
+	gcc -g3 -Wall -Wextra -o pc_server pc_side/pc_server.c pc_side/pc_request.c pc_side/pc_mm.c pc_side/pc_mlib.c pc_side/dict.c pc_side/pc_magazine.c pc_side/pc_transport.c pc_side/pc_event.c pc_side/pc_latency.c pc_side/pc_capture.c pc_side/pc_ring.c pc_side/pc_shadow.c shared_side/req_codec.c shared_side/link_frame.c -lpthread
 
 $(TARGET).elf: $(OBJS)
 	$(CC) $(OBJS) $(LDFLAGS) -o $(OBJDIR)/$@
@@ -119,6 +119,6 @@ burn:
 clean:
 	@echo "Cleaning..."
 	@rm -rf $(OBJDIR)/
-	@rm -f pc_server
+	@rm -f pc_server mcu_emu
 
 .PHONY: all build size clean burn debug disass disass-all
@@ -0,0 +1,173 @@
+# python capture_to_rep.py capture rep [session]
+# Convert a pc_server request capture (CAPTURE_FILE) into a .rep trace file.
+# Pointers are mapped to allocation ids using the server's responses. The capture is split into sessions at every
+# sbrk reset, session selects which one is written (default 0).
+
+import sys
+
+MALLOC, FREE, REALLOC, SBRK, MAG_USED, MEMALIGN, RESIZE, FREE_SIZED = 0, 1, 2, 3, 4, 7, 9, 10
+CAPTURE_RESPONSE, CAPTURE_GRANT = 0x10, 0x11
+CAPTURE_MAGIC = b'OHCAP1'
+
+capture_file = sys.argv[1]
+rep_file = sys.argv[2]
+session = int(sys.argv[3]) if len(sys.argv) > 3 else 0
+
+# Yield (kind, fields) records from capture data, stops at a truncated record
+def read_records(data):
+    pos = len(CAPTURE_MAGIC)
+
+    def varint():
+        nonlocal pos
+        value = shift = 0
+        while True:
+            byte = data[pos]
+            pos += 1
+            value |= (byte & 0x7F) << shift
+            shift += 7
+            if byte < 0x80:
+                return value
+
+    while pos < len(data):
+        try:
+            varint() # Time since previous record, not needed in .rep
+            kind = data[pos]
+            pos += 1
+            if kind == CAPTURE_RESPONSE:
+                yield kind, (varint(),)
+            elif kind == CAPTURE_GRANT:
+                size = varint()
+                yield kind, (size, [varint() for _ in range(varint())])
+            else:
+                yield kind, (varint(), varint())
+        except IndexError:
+            print('Capture truncated')
+            return
+
+# Split records into sessions, each starting at an sbrk reset
+def split_sessions(records):
+    sessions = []
+    for kind, fields in records:
+        if kind == SBRK and fields[0] == 0:
+            if fields[1] == 0:
+                break # End signal
+            sessions.append([])
+        elif sessions:
+            sessions[-1].append((kind, fields))
+    return sessions
+
+# Rebuild allocation ids and operations of one session
+def convert(records):
+    ops = []
+    ids = {} # Live pointer to (id, size)
+    next_id = 0
+    pending = None # Malloc or realloc waiting for its response
+    moves = {} # Old pointer of a realloc that needs a malloc, to id
+    move_next = [] # Moved ids waiting for their new block, in order
+    granted = {} # Magazine blocks not yet reported as used, per size, MCU takes from the end
+    early = {} # Magazine blocks seen freed before their use was reported, per size
+    live = peak = 0
+    unknown = 0
+
+    def alloc(ptr, size, response=False):
+        nonlocal next_id, live, peak
+        if response and move_next:
+            # New block of a realloc that could not grow in place
+            ids[ptr] = (move_next.pop(0), size)
+            return
+        ids[ptr] = (next_id, size)
+        ops.append(f'a {next_id} {size}')
+        next_id += 1
+        live += size
+        peak = max(peak, live)
+
+    def take_granted(size, ptr=None):
+        stack = granted.get(size, [])
+        if ptr is None:
+            return stack.pop() if stack else None
+        stack.remove(ptr)
+        return ptr
+
+    for kind, fields in records:
+        if kind in (MALLOC, MEMALIGN):
+            pending = (MALLOC, fields[0], 0)
+        elif kind in (REALLOC, RESIZE):
+            pending = (REALLOC, fields[0], fields[1])
+        elif kind == CAPTURE_RESPONSE and pending:
+            request, size, old = pending
+            ptr = fields[0]
+            if request == MALLOC:
+                if ptr:
+                    alloc(ptr, size, True)
+                    pending = None
+                # Null response: the MCU extends the heap and resends
+            else:
+                pending = None
+                if old not in ids:
+                    unknown += 1
+                    continue
+                block_id, old_size = ids[old]
+                ops.append(f'r {block_id} {size}')
+                live += size - old_size
+                peak = max(peak, live)
+                ids[old] = (block_id, size)
+                if ptr != old:
+                    # MCU mallocs a new block, copies and frees the old one
+                    moves[old] = block_id
+                    move_next.append(block_id)
+        elif kind == CAPTURE_GRANT:
+            granted.setdefault(fields[0], []).extend(fields[1])
+        elif kind == MAG_USED:
+            size, count = fields
+            already = min(early.get(size, 0), count)
+            early[size] = early.get(size, 0) - already
+            for _ in range(count - already):
+                ptr = take_granted(size)
+                if ptr is not None:
+                    alloc(ptr, size)
+        elif kind in (FREE, FREE_SIZED):
+            ptr = fields[1]
+            if ptr in moves:
+                block_id = moves.pop(ptr)
+                size = ids.pop(ptr)[1]
+                if block_id in move_next:
+                    # No malloc response was seen, the new block came from a magazine
+                    move_next.remove(block_id)
+                    new = take_granted(size)
+                    if new is not None:
+                        ids[new] = (block_id, size)
+                        early[size] = early.get(size, 0) + 1
+                continue
+            if ptr not in ids:
+                # Magazine block handed out before its use was reported
+                for size, stack in granted.items():
+                    if ptr in stack:
+                        take_granted(size, ptr)
+                        early[size] = early.get(size, 0) + 1
+                        alloc(ptr, size)
+                        break
+            if ptr in ids:
+                block_id, size = ids.pop(ptr)
+                ops.append(f'f {block_id}')
+                live -= size
+            else:
+                unknown += 1
+    if unknown:
+        print(f'{unknown} requests on unknown pointers skipped')
+    return ops, next_id, peak
+
+with open(capture_file, 'rb') as f:
+    data = f.read()
+if not data.startswith(CAPTURE_MAGIC):
+    sys.exit(f'{capture_file} is not a pc_server capture')
+
+sessions = split_sessions(read_records(data))
+if session >= len(sessions):
+    sys.exit(f'{capture_file} has {len(sessions)} sessions')
+
+ops, num_ids, peak = convert(sessions[session])
+with open(rep_file, 'w') as f:
+    f.write(f'{max(peak, 1)}\n{num_ids}\n{len(ops)}\n1\n')
+    f.write('\n'.join(ops) + '\n')
+
+print(f'{rep_file} created from session {session} of {len(sessions)}: {num_ids} ids, {len(ops)} ops')
@@ -0,0 +1,274 @@
+/*
+ * Runs each MCU malloc library API against pc_server and checks the results, built
+ * with the emulation files in place of the trace driver (make emu_apitest).
+ */
+#include "mcu.h"
+#include "mcu_mm.h"
+#include "mcu_syscalls.h"
+#include "memlib.h"
+#include "mcu_local.h"
+#include "uart_comms.h"
+
+static char msg[MAXLINE];
+static int failures = 0;
+
+// Record a failed check
+static void fail(const char * test, const char * what) {
+	sprintf(msg, "FAIL %s: %s\n", test, what);
+	var_print(msg);
+	failures++;
+}
+
+// Whether the size byte block at ptr lies inside the offloaded heap or the local region
+static int in_heap(void * ptr, size_t size) {
+	if (local_owns(ptr)) {
+		return local_usable(ptr) >= size;
+	}
+	return (char *)ptr >= (char *)mem_heap_lo() && (char *)ptr + size <= (char *)mem_heap_hi() + 1;
+}
+
+// Fill size bytes at ptr with a pattern derived from seed
+static void fill(void * ptr, size_t size, size_t seed) {
+	for (size_t i=0; i<size; i++) {
+		((uint8_t *)ptr)[i] = (uint8_t)(seed + i*7);
+	}
+}
+
+// Whether size bytes at ptr still hold the pattern of seed
+static int filled(void * ptr, size_t size, size_t seed) {
+	for (size_t i=0; i<size; i++) {
+		if (((uint8_t *)ptr)[i] != (uint8_t)(seed + i*7)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Mallocs and reallocs keep their contents and answer reallocs within the usable size in place
+static void test_realloc(void) {
+	char * ptr = sys_malloc(100);
+	char * moved;
+	size_t usable;
+	if (!ptr || !in_heap(ptr, 100) || ((uintptr_t)ptr % WIRE_ALIGN)) {
+		fail("realloc", "malloc returned a bad block");
+		return;
+	}
+	fill(ptr, 100, 1);
+	usable = sys_malloc_usable_size(ptr);
+	if (usable < 100) {
+		fail("realloc", "usable size below the requested size");
+	} else if (sys_realloc(ptr, usable) != ptr) {
+		fail("realloc", "realloc within the usable size moved the block");
+	}
+	// Grow past what the block and its neighbours can hold
+	moved = sys_realloc(ptr, 3000);
+	if (!moved || !in_heap(moved, 3000) || !filled(moved, 100, 1)) {
+		fail("realloc", "growing realloc lost the contents");
+	}
+	moved = sys_realloc(moved, 40);
+	if (!moved || !filled(moved, 40, 1)) {
+		fail("realloc", "shrinking realloc lost the contents");
+	}
+	sys_free(moved);
+}
+
+// Memalign returns usable blocks at a multiple of the alignment, behind blocks that leave the heap misaligned
+static void test_memalign(void) {
+	void * ptr;
+	void * spacers[8];
+	size_t count = 0;
+	for (size_t align=8; align<=1024; align*=2) {
+		spacers[count++] = sys_malloc(align + 40);
+		ptr = sys_memalign(align, 24 + align);
+		if (!ptr || ((uintptr_t)ptr % align) || !in_heap(ptr, 24 + align)) {
+			fail("memalign", "block is not aligned");
+		} else if (sys_malloc_usable_size(ptr) < 24 + align) {
+			fail("memalign", "usable size below the requested size");
+		}
+		if (ptr) {
+			fill(ptr, 24 + align, align);
+			sys_free(ptr);
+		}
+	}
+	sys_free_bulk(count, spacers);
+	if (sys_memalign(24, 8)) {
+		fail("memalign", "alignment that is not a power of 2 was accepted");
+	}
+}
+
+// Bulk malloc over BULK_MAX blocks returns distinct blocks that do not overlap
+static void test_bulk(void) {
+	size_t sizes[BULK_MAX + 9];
+	void * ptrs[BULK_MAX + 9];
+	size_t count = BULK_MAX + 9;
+	for (size_t i=0; i<count; i++) {
+		sizes[i] = 8 + (i*37)%300;
+	}
+	sys_malloc_bulk(count, sizes, ptrs);
+	for (size_t i=0; i<count; i++) {
+		if (!ptrs[i] || !in_heap(ptrs[i], sizes[i])) {
+			fail("bulk", "block missing or outside the heap");
+			return;
+		}
+		fill(ptrs[i], sizes[i], i);
+	}
+	for (size_t i=0; i<count; i++) {
+		if (!filled(ptrs[i], sizes[i], i)) {
+			fail("bulk", "blocks overlap");
+			break;
+		}
+	}
+	sys_free_bulk(count, ptrs);
+}
+
+// Results handed to async callbacks
+static void * callback_ptrs[ASYNC_HANDLES];
+static size_t callback_count = 0;
+
+// Store the result of an async request in the slot given as its argument
+static void async_done(void * ptr, void * arg) {
+	*(void **)arg = ptr;
+	callback_count++;
+}
+
+// Async mallocs and reallocs, more than REQ_SLOTS at once, finished by polling, awaiting and callbacks
+static void test_async(void) {
+	int handles[ASYNC_HANDLES];
+	void * ptrs[ASYNC_HANDLES];
+	size_t started = 0;
+	int handle;
+
+	// Sizes above MAG_MAX_SIZE go to the server
+	for (size_t i=0; i<ASYNC_HANDLES; i++) {
+		handles[i] = sys_malloc_async(MAG_MAX_SIZE + 64*(i+1), NULL, NULL);
+		if (handles[i] < 0) {
+			fail("async", "no handle for a malloc");
+			return;
+		}
+	}
+	if (sys_malloc_async(64, NULL, NULL) >= 0) {
+		fail("async", "handle given out past ASYNC_HANDLES");
+	}
+	for (size_t i=0; i<ASYNC_HANDLES; i++) {
+		while (!sys_mm_poll(handles[i]));
+		ptrs[i] = sys_mm_await(handles[i]);
+		if (!ptrs[i] || !in_heap(ptrs[i], MAG_MAX_SIZE + 64*(i+1))) {
+			fail("async", "malloc returned a bad block");
+			return;
+		}
+		fill(ptrs[i], MAG_MAX_SIZE + 64*(i+1), i);
+	}
+
+	// Grow every block through callbacks
+	for (size_t i=0; i<ASYNC_HANDLES; i++) {
+		callback_ptrs[i] = NULL;
+		if (sys_realloc_async(ptrs[i], 2*MAG_MAX_SIZE + 64*(i+1), async_done, &(callback_ptrs[i])) >= 0) {
+			started++;
+		}
+	}
+	if (started != ASYNC_HANDLES) {
+		fail("async", "no handle for a realloc");
+	}
+	while (callback_count < started) {
+		sys_mm_poll(-1);
+	}
+	for (size_t i=0; i<started; i++) {
+		if (!callback_ptrs[i] || !filled(callback_ptrs[i], MAG_MAX_SIZE + 64*(i+1), i)) {
+			fail("async", "realloc lost the contents");
+		}
+		sys_free(callback_ptrs[i]);
+	}
+
+	// A released handle has nothing to wait for
+	handle = sys_malloc_async(16, async_done, &(callback_ptrs[0]));
+	sys_mm_await(handle);
+	if (sys_mm_await(handle) || sys_mm_await(-1)) {
+		fail("async", "await of a released handle returned a block");
+	}
+	sys_free(callback_ptrs[0]);
+}
+
+// Heap statistics add up and follow mallocs and frees, with holes between live blocks
+static void test_stats(void) {
+	mm_heap_stats before, during, after;
+	void * ptrs[8];
+	if (sys_mm_stats(&before)) {
+		fail("stats", "server has no statistics");
+		return;
+	}
+	for (size_t i=0; i<8; i++) {
+		ptrs[i] = sys_malloc(1000);
+	}
+	for (size_t i=0; i<8; i+=2) {
+		sys_free(ptrs[i]);
+	}
+	sys_mm_stats(&during);
+	for (size_t i=1; i<8; i+=2) {
+		sys_free(ptrs[i]);
+	}
+	sys_mm_stats(&after);
+	if (during.live_bytes + during.free_bytes != mem_heapsize()) {
+		fail("stats", "live and free bytes do not add up to the heap size");
+	}
+	if (during.free_blocks < 4 || during.largest_free < 1000 || during.largest_free >= during.free_bytes ||
+			during.fragmentation != 1000 - (1000*during.largest_free)/during.free_bytes) {
+		fail("stats", "free block counts are inconsistent");
+	}
+	if (during.live_blocks != before.live_blocks + 4 || during.live_bytes < before.live_bytes + 4000) {
+		fail("stats", "mallocs not counted");
+	}
+	if (after.live_blocks != before.live_blocks || after.live_bytes != before.live_bytes) {
+		fail("stats", "frees not counted");
+	}
+}
+
+// Handler pools hand out blocks until they are empty and are refilled in thread context
+static void test_isr_pools(void) {
+	size_t pools = sizeof((size_t[])ISR_POOL_SIZES)/sizeof(size_t);
+	void * ptrs[sizeof((size_t[])ISR_POOL_SIZES)/sizeof(size_t) * ISR_POOL_BLOCKS + 1];
+	size_t count = 0;
+	void * ptr = mm_isr_malloc(16);
+	if (!ISR_POOL_BLOCKS) {
+		if (ptr) {
+			fail("isr pools", "block taken from pools that are off");
+		}
+		return;
+	}
+	if (!ptr || !in_heap(ptr, 16)) {
+		fail("isr pools", "no block in a filled pool");
+		return;
+	}
+	fill(ptr, 16, 3);
+	if (!mm_isr_free(ptr)) {
+		fail("isr pools", "free queue full");
+	}
+	sys_mm_isr_refill();
+	// Small blocks come from the larger pools once the smallest is empty
+	while (count < pools*ISR_POOL_BLOCKS && (ptrs[count] = mm_isr_malloc(16))) {
+		count++;
+	}
+	if (count != pools*ISR_POOL_BLOCKS) {
+		fail("isr pools", "refill did not fill every pool");
+	} else if (mm_isr_malloc(16)) {
+		fail("isr pools", "block taken from empty pools");
+	}
+	sys_mm_isr_refill();
+	if (!(ptrs[count] = mm_isr_malloc(16))) {
+		fail("isr pools", "refill left the pools empty");
+	}
+	sys_free_bulk(count+1, ptrs);
+}
+
+int main(void) {
+	sys_mm_init();
+	test_realloc();
+	test_memalign();
+	test_bulk();
+	test_async();
+	test_stats();
+	test_isr_pools();
+	sprintf(msg, "API test: %d failures\n", failures);
+	var_print(msg);
+	sys_mm_finish();
+	loop();
+}
@@ -0,0 +1,172 @@
+/*
+ * Host replacements for the MCU board support files (mcu.c, mcu_init.c,
+ * mcu_timer.c, mcu_mpu.c, mcu_dma.c and mcu_syscalls.c) used by the emulation build.
+ */
+#include "mcu.h"
+#include "mcu_init.h"
+#include "mcu_timer.h"
+#include "mcu_mpu.h"
+#include "mcu_dma.h"
+#include "mcu_mm.h"
+#include "mcu_syscalls.h"
+
+#include <time.h>
+#include <sys/mman.h>
+
+static char output_str[MAXLINE*2];
+size_t output_offset=0;
+void * sp_reset = (void *)(EMU_SRAM_BASE + 0x5000);
+
+// Start time of the emulated system timer
+static struct timespec start;
+
+// Print the debug output and exit, orange LED marks success
+void loop() {
+	led_on(ORANGE);
+	printf("%s\n", output_str);
+	fflush(stdout);
+	exit(0);
+}
+
+// Append printed output to output_str
+void var_print(char * str) {
+	if (output_offset + strlen(str) <= MAXLINE*2) {
+		strcat(output_str, str);
+		output_offset += strlen(str);
+	} else {
+		loop();
+	}
+}
+
+// LEDs are only reported for red, which marks a start signal error
+void led_init(void) {}
+void led_on(led l) {
+	if (l == RED) {
+		puts("Start signal error");
+	}
+}
+void led_off(led l) {}
+void led_toggle(led l) {}
+
+// No interrupts on the host
+uint32_t irq_save(void) {
+	return 0;
+}
+void irq_restore(uint32_t mask) {}
+
+// Map the simulated SRAM at the address the heap is linked at
+void mcu_init(void) {
+	void * sram = mmap((void *)EMU_SRAM_BASE, EMU_SRAM_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+	if (sram != (void *)EMU_SRAM_BASE) {
+		perror("Simulated SRAM mmap");
+		exit(1);
+	}
+}
+
+// Initialize timers
+void timer_init(void) {
+	clock_gettime(CLOCK_MONOTONIC, &start);
+}
+
+// Get current time in ms
+size_t get_time(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start.tv_sec)*1000 + (now.tv_nsec - start.tv_nsec)/1000000;
+}
+
+// No memory protection on the host
+void mpu_init(void) {}
+void proc_update(void) {}
+
+// Copies finish right away
+void dma_copy_init(void) {}
+void dma_copy_start(void * dst, const void * src, size_t size) {
+	memcpy(dst, src, size);
+}
+void dma_copy_wait(void) {}
+
+// Syscalls call the malloc library directly instead of through SVC
+void sys_mm_init(void) {
+	mm_init();
+}
+
+// Malloc size bytes of memory
+void * sys_malloc(size_t size) {
+	return mm_malloc(size);
+}
+
+// Free memory region at pointer
+void sys_free(void * ptr) {
+	mm_free(ptr);
+}
+
+// Free memory region at pointer allocated with size bytes
+void sys_free_sized(void * ptr, size_t size) {
+	mm_free_sized(ptr, size);
+}
+
+// Reallocate ptr to a size byte region and return the new pointer
+void * sys_realloc(void * ptr, size_t size) {
+	return mm_realloc(ptr, size);
+}
+
+// Allocate n blocks of sizes[i] bytes into out[i]
+void sys_malloc_bulk(size_t n, size_t * sizes, void ** out) {
+	mm_malloc_bulk(n, sizes, out);
+}
+
+// Free the n blocks at ptrs
+void sys_free_bulk(size_t n, void ** ptrs) {
+	mm_free_bulk(n, ptrs);
+}
+
+// Malloc size bytes at a multiple of alignment
+void * sys_memalign(size_t alignment, size_t size) {
+	return mm_memalign(alignment, size);
+}
+
+// Usable size of the block at ptr
+size_t sys_malloc_usable_size(void * ptr) {
+	return mm_malloc_usable_size(ptr);
+}
+
+// Start a malloc of size bytes
+int sys_malloc_async(size_t size, void (*callback)(void * ptr, void * arg), void * arg) {
+	return mm_malloc_async(size, callback, arg);
+}
+
+// Start a realloc of ptr to size bytes
+int sys_realloc_async(void * ptr, size_t size, void (*callback)(void * ptr, void * arg), void * arg) {
+	return mm_realloc_async(ptr, size, callback, arg);
+}
+
+// Continue async requests whose responses arrived, returns 1 once handle is done
+int sys_mm_poll(int handle) {
+	return mm_poll(handle);
+}
+
+// Wait for handle to finish, release it and return its pointer
+void * sys_mm_await(int handle) {
+	return mm_await(handle);
+}
+
+// Get statistics of the offloaded heap
+int sys_mm_stats(struct mm_heap_stats * stats) {
+	return mm_stats(stats);
+}
+
+// Free queued handler frees and refill the handler pools
+void sys_mm_isr_refill(void) {
+	mm_isr_refill();
+}
+
+// End communication session with server
+void sys_mm_finish(void) {
+	mm_finish();
+}
+
+// Return current time in ms
+size_t sys_get_time(void) {
+	return get_time();
+}
@@ -0,0 +1,174 @@
+/*
+ * Host replacements for uart.c and uart_dma.c used by the emulation build.
+ * The UART is a pty, UNIX socket or TCP connection to pc_server, chosen with
+ * the EMU_TRANSPORT (pty, unix or tcp) and EMU_ARG (path or port) environment
+ * variables. DMA transfers complete immediately.
+ */
+#include "uart_dma.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+// How long to wait for pc_server to come up in ms
+#define CONNECT_TIMEOUT 5000
+
+char msg_buffer[BUFFERSIZE] = {0};
+
+static int fd = -1; // Connection to pc_server
+
+// Open the pty slave created by pc_server
+static int pty_connect(const char * path) {
+	struct termios settings;
+	int tty = open(path, O_RDWR | O_NOCTTY);
+	if (tty >= 0) {
+		tcgetattr(tty, &settings);
+		cfmakeraw(&settings);
+		tcsetattr(tty, TCSANOW, &settings);
+	}
+	return tty;
+}
+
+// Connect to pc_server's UNIX socket
+static int unix_connect(const char * path) {
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path)-1);
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+// Connect to pc_server's localhost TCP port
+static int tcp_connect(const char * port) {
+	struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(atoi(port)), .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+	int one = 1;
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+		close(sock);
+		return -1;
+	}
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return sock;
+}
+
+// Read size bytes, waiting at most timeout ms (0 waits forever) for each chunk, returns 0 on timeout
+static int receive_bytes(uint8_t * buffer, size_t size, size_t timeout) {
+	struct pollfd p = {.fd = fd, .events = POLLIN};
+	ssize_t chunk;
+	while (size) {
+		if (poll(&p, 1, timeout ? (int)timeout : -1) <= 0) {
+			return 0;
+		}
+		chunk = read(fd, buffer, size);
+		if (chunk <= 0) {
+			puts("Server disconnected");
+			exit(1);
+		}
+		buffer += chunk;
+		size -= chunk;
+	}
+	return 1;
+}
+
+// Connect to pc_server, retrying until it is up
+void uart_init(void) {
+	const char * transport = getenv("EMU_TRANSPORT");
+	const char * arg = getenv("EMU_ARG");
+	int (*open_link)(const char *) = pty_connect;
+	const char * default_arg = PTYLINK;
+	if (transport && !strcmp(transport, "unix")) {
+		open_link = unix_connect;
+		default_arg = SOCKETPATH;
+	} else if (transport && !strcmp(transport, "tcp")) {
+		open_link = tcp_connect;
+		default_arg = TCPPORT;
+	}
+	for (size_t waited = 0; (fd = open_link(arg ? arg : default_arg)) < 0; waited += 10) {
+		if (waited > CONNECT_TIMEOUT) {
+			printf("Could not connect to pc_server at %s\n", arg ? arg : default_arg);
+			exit(1);
+		}
+		usleep(10000);
+	}
+}
+
+// Send size bytes of data starting at data pointer
+void uart_send(void * data, size_t size) {
+	ssize_t written;
+	while (size) {
+		written = write(fd, data, size);
+		if (written <= 0 && errno != EINTR) {
+			puts("Server disconnected");
+			exit(1);
+		}
+		if (written > 0) {
+			data = (uint8_t *)data + written;
+			size -= written;
+		}
+	}
+}
+
+// Receive size bytes of data and write to buffer
+void uart_receive(void * buffer, size_t size) {
+	receive_bytes(buffer, size, 0);
+}
+
+// Same as receive
+void uart_wait_receive(void * buffer, size_t size) {
+	uart_receive(buffer, size);
+}
+
+// Returns 1 when data from the server is waiting to be read
+int uart_rx_ready(void) {
+	struct pollfd p = {.fd = fd, .events = POLLIN};
+	return poll(&p, 1, 0) > 0;
+}
+
+// Send len bytes of payload in a frame
+void uart_frame_send(uint8_t type, uint8_t seq, void * payload, size_t len) {
+	uint8_t frame[FRAME_MAX];
+	uart_send(frame, frame_build(frame, type, seq, payload, len));
+}
+
+// Receive a frame within timeout ms (0 waits forever), returns FRAME_OK, FRAME_TIMEOUT or FRAME_CORRUPT
+int uart_frame_receive(uint8_t * frame, size_t timeout) {
+	// Hunt for the sync byte
+	do {
+		if (!receive_bytes(frame, 1, timeout)) {
+			return FRAME_TIMEOUT;
+		}
+	} while (frame[0] != FRAME_SYNC);
+	if (!receive_bytes(frame+1, FRAME_HEADER-1, timeout) || !receive_bytes(frame+FRAME_HEADER, FRAME_LEN(frame)+2, timeout)) {
+		return FRAME_TIMEOUT;
+	}
+	return frame_check(frame) ? FRAME_OK : FRAME_CORRUPT;
+}
+
+// DMA functions complete the transfer right away
+void uart_dma_init(void) {}
+void uart_tx_start(void * data, size_t size) {
+	uart_send(data, size);
+}
+void uart_tx_wait(void) {}
+void uart_rx_read(void * buffer, size_t size) {
+	uart_receive(buffer, size);
+}
+int uart_rx_pending(void) {
+	return uart_rx_ready();
+}
+void uart_tx_frame_start(uint8_t type, uint8_t seq, void * payload, size_t len) {
+	uart_frame_send(type, seq, payload, len);
+}
+int uart_rx_frame(uint8_t * frame, size_t timeout) {
+	return uart_frame_receive(frame, timeout);
+}
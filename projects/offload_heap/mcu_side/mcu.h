@@ -1,5 +1,11 @@
+#ifdef MCU_EMULATION
+// Host build, hardware is provided by emu_side
+#include <stdint.h>
+#include <stdlib.h>
+#else
 #include "../../../include/stm32f411xe.h"
 #include "../../../include/system_stm32f4xx.h"
+#endif
 
 #include <stdio.h>
 #include <string.h>
@@ -0,0 +1,48 @@
+#include "mcu_dma.h"
+
+// Set while DMA2 Stream0 copies
+static int copying = 0;
+
+// Setup memory to memory copies, only DMA2 can do them
+void dma_copy_init(void) {
+	RCC->AHB1ENR |= RCC_AHB1ENR_DMA2EN;
+	// Clear control register
+	DMA2_Stream0->CR = 0;
+	// Wait for DMA to disable
+	while(DMA2_Stream0->CR & DMA_SxCR_EN);
+	// Memory to memory runs through the FIFO, flushed once full
+	DMA2_Stream0->FCR = DMA_SxFCR_DMDIS | (0x3<<0);
+}
+
+// Start copying size bytes from src to dst, words go by DMA2 Stream0 and the remaining bytes by the CPU
+void dma_copy_start(void * dst, const void * src, size_t size) {
+	size_t words = size/4;
+
+	dma_copy_wait();
+	if ((((uintptr_t)dst | (uintptr_t)src) & 3) || words == 0 || words > 0xFFFF) {
+		// Unaligned or out of the stream's count range
+		memcpy(dst, src, size);
+		return;
+	}
+	memcpy((char *)dst + words*4, (const char *)src + words*4, size - words*4);
+
+	// Clear flags of the previous copy
+	DMA2->LIFCR = DMA_LIFCR_CTCIF0 | DMA_LIFCR_CHTIF0 | DMA_LIFCR_CTEIF0 | DMA_LIFCR_CDMEIF0 | DMA_LIFCR_CFEIF0;
+	// Source is the peripheral port in memory to memory mode
+	DMA2_Stream0->PAR = (uint32_t)src;
+	DMA2_Stream0->M0AR = (uint32_t)dst;
+	DMA2_Stream0->NDTR = words;
+	// DIR bit set to 10: memory to memory, words on both ports, both addresses increment, priority low so UART
+	// streams are served first
+	DMA2_Stream0->CR = (0x2<<6) | (0x2<<11) | (0x2<<13) | DMA_SxCR_PINC | DMA_SxCR_MINC;
+	DMA2_Stream0->CR |= DMA_SxCR_EN;
+	copying = 1;
+}
+
+// Wait for the running copy to finish
+void dma_copy_wait(void) {
+	if (copying) {
+		while (!(DMA2->LISR & (DMA_LISR_TCIF0 | DMA_LISR_TEIF0)));
+		copying = 0;
+	}
+}
@@ -0,0 +1,5 @@
+#include "mcu.h"
+
+void dma_copy_init(void); // Setup DMA2 for memory to memory copies
+void dma_copy_start(void * dst, const void * src, size_t size); // Start copying size bytes from src to dst
+void dma_copy_wait(void); // Wait for the running copy to finish
@@ -103,3 +103,15 @@ void mcu_init(void) {
 	// Make SVC call priority 3
 	NVIC_SetPriority(SVCall_IRQn, 6);
 }
+
+// Mask interrupts, returns the previous mask for irq_restore
+uint32_t irq_save(void) {
+	uint32_t mask = __get_PRIMASK();
+	__disable_irq();
+	return mask;
+}
+
+// Restore the interrupt mask irq_save returned
+void irq_restore(uint32_t mask) {
+	__set_PRIMASK(mask);
+}
@@ -14,3 +14,5 @@ void led_off(led l); // Turn off LED
 void led_toggle(led l); // Toggle LED state
 
 void mcu_init(void); // Initialize LED and fault handers
+uint32_t irq_save(void); // Mask interrupts, returns the previous mask for irq_restore
+void irq_restore(uint32_t mask); // Restore the interrupt mask irq_save returned
@@ -0,0 +1,181 @@
+/* Small block allocator for the on-chip region of the hybrid heap, the implicit free list and first fit search
+ * of projects/heap/mm.c over a fixed LOCAL_HEAP byte region instead of sbrk.
+ * Header and footers are unsigned 32-bit integers, with the first 29 bits storing the size, and the last bit indicating if block is allocated (0 for free 1 for allocated)
+ * The bp block pointer in macros refers to start of payload.
+ * |header|payload|footer|header...
+ *        ^
+ *       bp
+ * Every function masks interrupts, so handlers can malloc and free local blocks.
+ */
+#include "mcu_local.h"
+#include "mcu_init.h"
+#include "uart_comms.h"
+
+#define WSIZE 4
+#define DSIZE 8
+
+#define PACK(size, alloc) ((size) | (alloc)) // Put size and alloc bit in one word
+
+// Read and write to address p
+#define GET(p) (*(unsigned int *)(p))
+#define PUT(p, val) (*(unsigned int *)(p) = (val))
+
+// Read size and alloc bit at p
+#define GET_SIZE(p) (GET(p) & ~0x7)
+#define GET_ALLOC(p) (GET(p) & 0x1)
+
+// Get header and footer address of block pointer bp
+#define HDRP(bp) ((char *)(bp) - WSIZE)
+#define FTRP(bp) ((char *)(bp) + GET_SIZE(HDRP(bp)) - DSIZE)
+
+// Get address of next and previous block of bp
+#define NEXT_BLKP(bp) ((char *)(bp) + GET_SIZE(((char *)(bp) - WSIZE)))
+#define PREV_BLKP(bp) ((char *)(bp) - GET_SIZE(((char *)(bp) - DSIZE)))
+
+// Region size rounded down to double words
+#define LOCAL_SIZE ((LOCAL_HEAP/DSIZE)*DSIZE)
+
+static uint8_t local_region[LOCAL_SIZE > 4*DSIZE ? LOCAL_SIZE : 4*DSIZE] __attribute__((aligned(DSIZE)));
+
+// Pointer to prologue block
+static void * heap_listp;
+
+// Coalesce free blocks with adjacent free blocks, return pointer to coalesced free block
+static void * coalesce(void * bp) {
+	// Alloc bit of prev and next block
+	size_t prev_alloc = GET_ALLOC(FTRP(PREV_BLKP(bp)));
+	size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
+	// Current block size
+	size_t size = GET_SIZE(HDRP(bp));
+
+	if (prev_alloc && next_alloc) {
+		// Neither are free
+		return bp;
+	} else if (prev_alloc && !next_alloc) {
+		// Coalesce with next block
+		size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
+		PUT(HDRP(bp), PACK(size, 0));
+		PUT(FTRP(bp), PACK(size, 0));
+	} else if (!prev_alloc && next_alloc) {
+		// Coalesce with previous block
+		size += GET_SIZE(HDRP(PREV_BLKP(bp)));
+		PUT(FTRP(bp), PACK(size, 0));
+		PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
+		bp = PREV_BLKP(bp);
+	} else {
+		// Both blocks are free
+		size += GET_SIZE(HDRP(NEXT_BLKP(bp))) + GET_SIZE(HDRP(PREV_BLKP(bp)));
+		PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
+		PUT(FTRP(NEXT_BLKP(bp)), PACK(size, 0));
+		bp = PREV_BLKP(bp);
+	}
+	return bp;
+}
+
+// First fit search, return pointer to payload section, NULL if no fit found
+static void * first_fit(size_t asize) {
+	void * cur_search = heap_listp;
+	// Repeat until epilogue block is reached
+	while ((GET_SIZE(HDRP(cur_search))!=0)) {
+		if ((GET_ALLOC(HDRP(cur_search))==0) && (GET_SIZE(HDRP(cur_search)) >= asize)) {
+			return cur_search;
+		} else {
+			cur_search = NEXT_BLKP(cur_search);
+		}
+	}
+	return NULL;
+}
+
+// Put an asize allocated block at bp
+static void place(void * bp, size_t asize) {
+	size_t original_size = GET_SIZE(HDRP(bp));
+	size_t free_size;
+	void * free_p;
+	// Check if there is free block leftover
+	if (original_size >= (asize + DSIZE)) {
+		// Split block into allocated and free blocks
+		free_size = original_size-asize;
+		// Header and footer of free block
+		free_p = (char *)(bp) + asize;
+		PUT(HDRP(free_p), PACK(free_size, 0));
+		PUT(FTRP(free_p), PACK(free_size, 0));
+		// Header and footer of allocated block
+		PUT(HDRP(bp), PACK(asize, 1));
+		PUT(FTRP(bp), PACK(asize, 1));
+	} else {
+		// Allocate entire block
+		PUT(HDRP(bp), PACK(original_size, 1));
+		PUT(FTRP(bp), PACK(original_size, 1));
+	}
+}
+
+// Setup the local region: padding, prologue, one free block and the epilogue
+void local_init(void) {
+	size_t size = sizeof(local_region) - 4*WSIZE;
+
+	heap_listp = local_region;
+	PUT(heap_listp, 0); //Padding
+	// Prologue header and footer
+	PUT(heap_listp + WSIZE, PACK(DSIZE, 1));
+	PUT(heap_listp + WSIZE*2, PACK(DSIZE, 1));
+	heap_listp += 2*WSIZE;
+
+	// Free block header and footer
+	PUT(HDRP(NEXT_BLKP(heap_listp)), PACK(size, 0));
+	PUT(FTRP(NEXT_BLKP(heap_listp)), PACK(size, 0));
+	// Epilogue header
+	PUT(local_region + sizeof(local_region) - WSIZE, PACK(0, 1));
+}
+
+// Malloc from the local region, NULL when nothing fits
+void * local_malloc(size_t size) {
+	size_t asize; // Adjusted block size
+	char * bp;
+	uint32_t mask;
+
+	// Ignore 0 size
+	if (size == 0) {
+		return NULL;
+	}
+
+	// Add overhead and alignment to block size
+	if (size <= DSIZE) {
+		asize = 2*DSIZE;
+	} else {
+		asize = DSIZE * ((size + (DSIZE) + (DSIZE-1))/DSIZE); // Add overhead and make rounding floor
+	}
+
+	mask = irq_save();
+	if ((bp = first_fit(asize)) != NULL) {
+		place(bp, asize);
+	}
+	irq_restore(mask);
+	return bp;
+}
+
+// Free a block of the local region
+void local_free(void * ptr) {
+	uint32_t mask = irq_save();
+	size_t size = GET_SIZE(HDRP(ptr));
+
+	// Set header and footer to free
+	PUT(HDRP(ptr), PACK(size, 0));
+	PUT(FTRP(ptr), PACK(size, 0));
+	coalesce(ptr);
+	irq_restore(mask);
+}
+
+// Bytes of the local region, 0 without one
+size_t local_heapsize(void) {
+	return LOCAL_HEAP ? sizeof(local_region) : 0;
+}
+
+// Returns 1 when ptr is in the local region
+int local_owns(void * ptr) {
+	return LOCAL_HEAP && (uint8_t *)ptr >= local_region && (uint8_t *)ptr < local_region + sizeof(local_region);
+}
+
+// Usable bytes of the local block at ptr, its size without header and footer
+size_t local_usable(void * ptr) {
+	return GET_SIZE(HDRP(ptr)) - DSIZE;
+}
@@ -0,0 +1,8 @@
+#include "mcu.h"
+
+void local_init(void); // Setup the local region as one free block
+void * local_malloc(size_t size); // Malloc from the local region, NULL when nothing fits
+void local_free(void * ptr); // Free a block of the local region
+size_t local_heapsize(void); // Bytes of the local region, 0 without one
+int local_owns(void * ptr); // Returns 1 when ptr is in the local region
+size_t local_usable(void * ptr); // Usable bytes of the local block at ptr
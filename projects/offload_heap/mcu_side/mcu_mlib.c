@@ -37,6 +37,7 @@ void mem_init(void)
 	// Sbrk request: size=0 for reset, ptr set to heap start
 	req = (mem_request){.request=SBRK, .size=0, .ptr=mem_brk};
 	req_send(&req);
+	codec_set_base((uint32_t)(uintptr_t)mem_start_brk);
 	proc_update();
 }
 
@@ -59,6 +60,7 @@ void mem_reset_brk()
 	// Sbrk request: size=0 for reset, ptr set to heap start
 	req = (mem_request){.request = SBRK, .size=0, .ptr=mem_brk};
 	req_send(&req);
+	codec_set_base((uint32_t)(uintptr_t)mem_start_brk);
 	proc_update();
 }
 
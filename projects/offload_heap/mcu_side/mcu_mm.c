@@ -4,6 +4,9 @@
 #include "mcu_mpu.h"
 #include "mcu_init.h"
 #include "mcu_timer.h"
+#include "mcu_dma.h"
+#include "mcu_local.h"
+#include "mcu_pool.h"
 
 /* single word (4) or double word (8) alignment */
 #define ALIGNMENT 4
@@ -16,6 +19,188 @@
 #define CHUNKSIZE (1<<12) // Heap request chunk
 
 #define MAX(x,y) ((x) > (y) ? (x) : (y))
+#define MIN(x,y) ((x) < (y) ? (x) : (y))
+
+// Requests without a response (frees, magazine reports) waiting to be sent to the server
+static mem_request send_queue[FREE_QUEUE_SIZE ? FREE_QUEUE_SIZE : 1];
+static size_t send_queue_count = 0;
+
+// Session options offered to the server, replaced by the agreed ones in mm_init
+static codec_hello session = {
+	.version = PROTOCOL_VERSION,
+	.batch = FREE_QUEUE_SIZE,
+	.frame = FRAME_MAX_PAYLOAD,
+	.caps = (COMPACT_ENCODING ? CAP_COMPACT : 0) | (MAGAZINES ? CAP_MAGAZINES : 0) | (REQ_SLOTS > 1 ? CAP_REQ_ID : 0) | CAP_BULK | CAP_MEMALIGN |
+			CAP_USABLE | CAP_SIZED_FREE | CAP_STATS,
+};
+
+// Blocks pre-allocated by the server for one request size
+typedef struct {
+	size_t size; // Request size served, 0 when slot is unused
+	size_t count; // Blocks left in magazine
+	size_t used; // Blocks handed out since the last report
+	void * blocks[MAG_BLOCKS];
+} magazine;
+
+static magazine mag_table[MAG_CLASSES] = {0};
+
+// Requested size and usable size reported by the server for a block, direct mapped by address, a collision drops the older block
+typedef struct {
+	uint16_t key; // Heap offset in WIRE_ALIGN units plus one, 0 when unused
+	uint16_t usable; // Usable size in WIRE_ALIGN units, 0 when not known
+	uint16_t size; // Requested size in bytes, 0 when not known
+} usable_elt;
+
+static usable_elt usable_table[USABLE_TABLE ? USABLE_TABLE : 1] = {0};
+
+// Async request states
+#define ASYNC_FREE 0 // Handle unused
+#define ASYNC_RUN 1 // Started, no server request in flight
+#define ASYNC_WAIT 2 // Waiting for the server's response
+#define ASYNC_DONE 3 // Result ready for mm_await
+
+// Malloc, realloc or memalign that may span several server requests
+typedef struct {
+	uint8_t state;
+	uint8_t request; // Server request waited on, MALLOC, REALLOC or MEMALIGN
+	int slot; // Request slot of the server request
+	size_t size;
+	size_t align; // Alignment of a memalign
+	void * old; // Block a realloc moves out of, NULL when nothing needs copying
+	size_t old_size; // Bytes to copy out of old
+	void * result;
+	mm_callback callback; // Called with the result once done, the handle is released first
+	void * arg;
+} mm_async;
+
+static mm_async async_table[ASYNC_HANDLES] = {0};
+
+static void async_step(mm_async * a);
+
+// Send all queued requests to the server in one transfer
+static void send_queue_flush(void) {
+	if (send_queue_count) {
+		req_send_batch(send_queue, send_queue_count);
+		send_queue_count = 0;
+	}
+}
+
+// Queue a request without response, sending the queue once full
+static void send_queue_push(mem_request req) {
+	if (FREE_QUEUE_SIZE && session.batch > 1) {
+		send_queue[send_queue_count++] = req;
+		if (send_queue_count >= session.batch) {
+			send_queue_flush();
+		}
+	} else {
+		req_send(&req);
+	}
+}
+
+// Queue usage reports of magazines with handed out blocks, release emptied slots
+static void mag_report(void) {
+	for (size_t i=0; i<MAG_CLASSES; i++) {
+		if (mag_table[i].used) {
+			send_queue_push((mem_request){.request=MAG_USED, .size=mag_table[i].size, .ptr=(void *)(uintptr_t)mag_table[i].used});
+			mag_table[i].used = 0;
+			if (mag_table[i].count == 0) {
+				mag_table[i].size = 0;
+			}
+		}
+	}
+}
+
+// Send queued frees and magazine reports so the server's view of the heap is current
+static void mm_sync(void) {
+	pool_drain();
+	if (MAGAZINES) {
+		mag_report();
+	}
+	send_queue_flush();
+}
+
+// Take a block from the magazine of size, NULL if there is none
+static void * mag_take(size_t size) {
+	for (size_t i=0; i<MAG_CLASSES; i++) {
+		if (mag_table[i].size == size && mag_table[i].count) {
+			mag_table[i].used++;
+			return mag_table[i].blocks[--mag_table[i].count];
+		}
+	}
+	return NULL;
+}
+
+// Store a grant of count size byte blocks from the server in a free magazine slot
+static void mag_fill(size_t size, void ** blocks, size_t count) {
+	for (size_t i=0; i<MAG_CLASSES; i++) {
+		if (mag_table[i].size == 0) {
+			mag_table[i].size = size;
+			mag_table[i].count = count;
+			mag_table[i].used = 0;
+			memcpy(mag_table[i].blocks, blocks, count*sizeof(void *));
+			return;
+		}
+	}
+	// Server only grants when a slot is free
+	var_print("No free magazine slot");
+	loop();
+}
+
+// Table key of ptr, 0 when it is out of the table's reach
+static uint16_t usable_key(void * ptr) {
+	size_t units = ((char *)ptr - (char *)mem_heap_lo())/WIRE_ALIGN + 1;
+	return (units > 0xFFFF) ? 0 : units;
+}
+
+// Entry for ptr
+static usable_elt * usable_slot(void * ptr) {
+	return &(usable_table[usable_key(ptr) & (USABLE_TABLE-1)]);
+}
+
+// Remember requested size and usable size (0 when not known) of the block at ptr
+static void usable_record(void * ptr, size_t size, size_t usable) {
+	usable_elt * elt;
+	if (!USABLE_TABLE || !ptr) {
+		return;
+	}
+	elt = usable_slot(ptr);
+	elt->key = usable_key(ptr);
+	elt->size = (size > 0xFFFF) ? 0 : size;
+	usable /= WIRE_ALIGN;
+	elt->usable = (usable > 0xFFFF) ? 0xFFFF : usable;
+}
+
+// Usable size of the block at ptr, 0 when it is not known
+static size_t usable_get(void * ptr) {
+	usable_elt * elt;
+	if (!USABLE_TABLE || !ptr) {
+		return 0;
+	}
+	elt = usable_slot(ptr);
+	return (elt->key && elt->key == usable_key(ptr)) ? elt->usable*WIRE_ALIGN : 0;
+}
+
+// Requested size of the block at ptr, 0 when it is not known
+static size_t usable_requested(void * ptr) {
+	usable_elt * elt;
+	if (!USABLE_TABLE || !ptr) {
+		return 0;
+	}
+	elt = usable_slot(ptr);
+	return (elt->key && elt->key == usable_key(ptr)) ? elt->size : 0;
+}
+
+// Forget the block at ptr once it is freed
+static void usable_forget(void * ptr) {
+	usable_elt * elt;
+	if (!USABLE_TABLE || !ptr) {
+		return;
+	}
+	elt = usable_slot(ptr);
+	if (elt->key == usable_key(ptr)) {
+		elt->key = 0;
+	}
+}
 
 // Extend heap by words * WSIZE with alignment, return 1 on success 0 on fail
 static int extend_heap(size_t words) {
@@ -33,19 +218,31 @@ static int extend_heap(size_t words) {
 // Initialize memory request communication
 int mm_init(void)
 {
-	void * response = 0;
-
+	if (LOCAL_HEAP) {
+		local_init();
+	}
 	mem_req_setup();
 	mpu_init();
 
 	// Receive starting singal of 1 in every field
 	led_on(BLUE);
-	req_receive(&response);
-	if (response==(void *)1) {
-		// Signal correct - sbrk start chunk
+	if (req_receive_start()) {
+		// Signal correct - agree on options, then sbrk start chunk
+		req_hello(&session);
 		led_off(BLUE);
 		mem_init();
+		if (DMA_COPY_MIN) {
+			dma_copy_init();
+		}
 		extend_heap(4096/WSIZE);
+		if (ISR_POOL_BLOCKS) {
+			pool_refill();
+		}
+		timer_init();
+		return 0;
+	} else if (LOCAL_HEAP && !req_link_up()) {
+		// No server, every block comes from the local region
+		led_off(BLUE);
 		timer_init();
 		return 0;
 	} else {
@@ -58,94 +255,404 @@ int mm_init(void)
 	}
 }
 
-// Malloc: sends request and return PC's response, calls sbrk if needed
-void *mm_malloc(size_t size)
-{
-	size_t asize, extendsize;	
-	mem_request req;	
-	void * response;
+// Finish a with result ptr, moving the old block of a realloc into it
+static void async_finish(mm_async * a, void * ptr) {
+	if (a->old && ptr) {
+		if (DMA_COPY_MIN && a->old_size >= DMA_COPY_MIN) {
+			// Send the free and whatever else is queued while the copy runs
+			dma_copy_start(ptr, a->old, a->old_size);
+			mm_free(a->old);
+			mm_sync();
+			dma_copy_wait();
+		} else {
+			memcpy(ptr, a->old, a->old_size);
+			mm_free(a->old);
+		}
+	}
+	a->result = ptr;
+	a->state = ASYNC_DONE;
+	if (a->callback) {
+		a->state = ASYNC_FREE;
+		a->callback(ptr, a->arg);
+	}
+}
 
-	// Ignore 0 size
-	if (size == 0) {
-		return NULL;
+// Finish waiting async requests until a request slot is free
+static void async_room(void) {
+	size_t i;
+	while (req_full()) {
+		// Every taken slot belongs to a waiting handle, other requests are waited for right after they are sent
+		for (i=0; i<ASYNC_HANDLES && async_table[i].state != ASYNC_WAIT; i++);
+		if (i == ASYNC_HANDLES) {
+			var_print("No handle waits on a request slot");
+			loop();
+		}
+		async_step(&(async_table[i]));
 	}
+}
 
-	// Send malloc request to server
-	req = (mem_request){.request = MALLOC, .size = size, .ptr=NULL};
-	req_send(&req);
-	req_receive(&response);
+// Send the malloc, realloc or memalign request of a to the server
+static void async_submit(mm_async * a, uint32_t request) {
+	mem_request req = {.request = request, .size = a->size, .ptr = (request == REALLOC) ? a->old : NULL};
+	if (request == MEMALIGN) {
+		req.ptr = (void *)a->align;
+	}
+	// Server needs to see pending frees before placing the block
+	mm_sync();
+	async_room();
+	a->request = request;
+	a->slot = req_submit(&req);
+	a->state = ASYNC_WAIT;
+}
 
-	if (response) {
-		return response;
+// Serve the malloc of a from the local region or a magazine, or send it to the server
+static void async_malloc(mm_async * a) {
+	void * ptr;
+	if (LOCAL_HEAP && (a->size <= LOCAL_MAX || !req_link_up()) && (ptr = local_malloc(a->size))) {
+		async_finish(a, ptr);
+	} else if (!req_link_up()) {
+		async_finish(a, NULL);
+	} else if (MAGAZINES && (ptr = mag_take(codec_size(a->size)))) {
+		// Granted blocks hold at least their class size, a multiple of WIRE_ALIGN under the compact encoding
+		usable_record(ptr, a->size, (session.caps & CAP_COMPACT) ? codec_size(a->size) : 0);
+		async_finish(a, ptr);
 	} else {
-		// Need to extend heap
-		// Add overhead and alignment to block size
-		if (size <= WSIZE) {
-			asize = WSIZE;
+		async_submit(a, MALLOC);
+	}
+}
+
+// Start malloc (old NULL) or realloc of a
+static void async_start(mm_async * a, void * old, size_t size) {
+	a->state = ASYNC_RUN;
+	a->size = size;
+	a->old = old;
+	if (old == NULL) {
+		if (size == 0) {
+			async_finish(a, NULL);
+		} else {
+			async_malloc(a);
+		}
+	} else if (size == 0) {
+		a->old = NULL;
+		mm_free(old);
+		async_finish(a, old);
+	} else if (local_owns(old)) {
+		if (size <= local_usable(old)) {
+			a->old = NULL;
+			async_finish(a, old);
+		} else {
+			// Moves out, to the server when it outgrew the local threshold
+			a->old_size = local_usable(old);
+			async_malloc(a);
+		}
+	} else if (size <= usable_get(old)) {
+		// Fits the block as it is, the server learns the new size with the next queued requests
+		send_queue_push((mem_request){.request=RESIZE, .size=size, .ptr=old});
+		usable_record(old, size, usable_get(old));
+		a->old = NULL;
+		async_finish(a, old);
+	} else {
+		// A move copies the old block, learn its size before the server's answer rather than in between
+		a->old_size = usable_requested(old);
+		if (!a->old_size) {
+			a->old_size = mm_malloc_usable_size(old);
+		}
+		async_submit(a, REALLOC);
+	}
+}
+
+// Take the response of a, waiting for it if it has not arrived, and continue its request
+static void async_step(mm_async * a) {
+	req_response response;
+	size_t asize;
+
+	req_wait(a->slot, &response);
+	a->state = ASYNC_RUN;
+	if (!req_link_up() && a->request != REALLOC) {
+		// Link lost while waiting, the local region has no aligned blocks
+		if (a->request == MALLOC) {
+			async_malloc(a);
 		} else {
-			asize = WSIZE * ((size + (WSIZE) + (WSIZE-1))/WSIZE); // Add overhead and make rounding floor
-		}
-		extendsize = MAX(asize, CHUNKSIZE);
-
-		if (extend_heap(extendsize/WSIZE)) {
-			// Resend malloc request
-			// Send malloc request to server
-			req = (mem_request){.request = MALLOC, .size = size, .ptr=NULL};
-			req_send(&req);
-			req_receive(&response);
-			
-			return(response);
+			async_finish(a, NULL);
+		}
+		return;
+	}
+	if (a->request == REALLOC) {
+		if (response.ptr == a->old) {
+			// Address stays the same
+			usable_record(response.ptr, a->size, response.usable);
+			a->old = NULL;
+			async_finish(a, response.ptr);
 		} else {
-			// Not enough memory
-			return NULL;
+			if (!a->old_size) {
+				// Neither side knows where the old block ends, fail rather than copy past it
+				a->old = NULL;
+				async_finish(a, NULL);
+				return;
+			}
+			// Need to copy to new location, as much of the old block as fits the new one
+			a->old_size = MIN(a->old_size, a->size);
+			async_malloc(a);
 		}
+		return;
+	}
+
+	if (response.count) {
+		mag_fill(codec_size(a->size), response.blocks, response.count);
+	}
+	if (response.ptr) {
+		usable_record(response.ptr, a->size, response.usable);
+		async_finish(a, response.ptr);
+		return;
+	}
+	// Need to extend heap
+	// Add overhead and alignment to block size
+	if (a->size <= WSIZE) {
+		asize = WSIZE;
+	} else {
+		asize = WSIZE * ((a->size + (WSIZE) + (WSIZE-1))/WSIZE); // Add overhead and make rounding floor
+	}
+	if (extend_heap(MAX(asize + a->align, CHUNKSIZE)/WSIZE)) {
+		// Resend malloc request
+		async_submit(a, a->request);
+	} else {
+		// Not enough memory
+		async_finish(a, NULL);
+	}
+}
+
+// Wait for a to finish and return its result
+static void * async_wait(mm_async * a) {
+	while (a->state == ASYNC_WAIT) {
+		async_step(a);
+	}
+	return a->result;
+}
+
+// Take an unused handle, NULL when every handle is in use
+static mm_async * async_alloc(mm_callback callback, void * arg) {
+	for (size_t i=0; i<ASYNC_HANDLES; i++) {
+		if (async_table[i].state == ASYNC_FREE) {
+			async_table[i] = (mm_async){.state = ASYNC_RUN, .callback = callback, .arg = arg};
+			return &(async_table[i]);
+		}
+	}
+	return NULL;
+}
+
+// Malloc: sends request and return PC's response, calls sbrk if needed
+void *mm_malloc(size_t size)
+{
+	mm_async a = {0};
+	async_start(&a, NULL, size);
+	return async_wait(&a);
+}
+
+// Memalign: malloc size bytes at a multiple of alignment (a power of 2), NULL when the server has no memalign
+void *mm_memalign(size_t alignment, size_t size)
+{
+	mm_async a = {.state = ASYNC_RUN, .size = size, .align = alignment};
+	if (alignment & (alignment-1)) {
+		return NULL;
+	}
+	if (alignment <= DSIZE) {
+		// Every block is aligned this far
+		return mm_malloc(size);
 	}
+	if (size == 0 || !(session.caps & CAP_MEMALIGN)) {
+		return NULL;
+	}
+	async_submit(&a, MEMALIGN);
+	return async_wait(&a);
 }
 
-// Free: Send request to pc
+// Free: Queue request for pc, sent once the queue fills or before the next malloc/realloc
 void mm_free(void *ptr)
 {
-	mem_request req = {.request=FREE, .size=0, .ptr=ptr};
-	req_send(&req);
+	if (local_owns(ptr)) {
+		local_free(ptr);
+		return;
+	}
+	usable_forget(ptr);
+	send_queue_push((mem_request){.request=FREE, .size=0, .ptr=ptr});
+}
+
+// Sized free: free ptr of a size byte block, the server checks it against the block
+void mm_free_sized(void *ptr, size_t size)
+{
+	if (!(session.caps & CAP_SIZED_FREE) || !ptr || local_owns(ptr)) {
+		mm_free(ptr);
+		return;
+	}
+	usable_forget(ptr);
+	send_queue_push((mem_request){.request=FREE_SIZED, .size=size, .ptr=ptr});
 }
 
 // Realloc: Send request to PC and return response, calls malloc if needed
 void *mm_realloc(void *ptr, size_t size)
 {
-    void *oldptr = ptr;
-    void *newptr;
-	mem_request req;
-	void * response;
+	mm_async a = {0};
+	async_start(&a, ptr, size);
+	return async_wait(&a);
+}
 
-	// Special cases
-	if (ptr == NULL) {
-		newptr = mm_malloc(size);
-		return newptr;
+// Usable size of the block at ptr, from the side table or else asked from the server, 0 when unknown
+size_t mm_malloc_usable_size(void *ptr)
+{
+	req_response response;
+	mem_request req = {.request = MALLOC_USABLE, .size = 0, .ptr = ptr};
+	size_t usable = usable_get(ptr);
+	if (local_owns(ptr)) {
+		return local_usable(ptr);
 	}
-	if (size == 0) {
-		mm_free(ptr);
-		return ptr;
+	if (usable || !ptr || !(session.caps & CAP_USABLE) || !req_link_up()) {
+		return usable;
+	}
+	// Server must have seen every resize and free before it is asked
+	mm_sync();
+	async_room();
+	req_wait(req_submit(&req), &response);
+	usable_record(response.ptr, usable_requested(ptr), response.usable);
+	return response.usable;
+}
+
+// Ask the server for its heap statistics, returns 0 on success and -1 when the server has none
+int mm_stats(mm_heap_stats * stats)
+{
+	uint32_t counts[CODEC_STATS_WORDS];
+	req_response response;
+	if (!(session.caps & CAP_STATS)) {
+		return -1;
+	}
+	// Server must have seen every free before it counts
+	mm_sync();
+	async_room();
+	req_wait(req_submit_stats(counts), &response);
+	if (!req_link_up()) {
+		return -1;
 	}
+	*stats = (mm_heap_stats){counts[0], counts[1], counts[2], counts[3], counts[4], counts[5]};
+	return 0;
+}
 
-	// Send realloc request to server
-	req = (mem_request){.request = REALLOC, .size = size, .ptr=ptr};
-	req_send(&req);
-	req_receive(&response);
+// Malloc count blocks of sizes into out, placed by the server in one request per BULK_MAX blocks
+void mm_malloc_bulk(size_t count, size_t * sizes, void ** out)
+{
+	size_t limit = 0; // Blocks per bulk request, 0 when the server has no bulk malloc
+	size_t chunk;
+	req_response response;
 
-	if (response == oldptr) {
-		// Address stays the same
-		return response;
-	} else {
-		// Need to copy to new location
-		newptr = mm_malloc(size);
-		memcpy(newptr, oldptr, size);
-		mm_free(oldptr);
-		return newptr;
+	if ((session.caps & CAP_BULK) && session.frame > CODEC_MAX_REQ) {
+		// Request and response both go in one frame
+		limit = (session.frame - CODEC_MAX_REQ)/CODEC_MAX_WORD;
+		limit = (limit > BULK_MAX) ? BULK_MAX : limit;
+	}
+	for (size_t done=0; done<count; done+=chunk) {
+		chunk = (count-done < limit) ? (count-done) : limit;
+		if (chunk > 1) {
+			// Server needs to see pending frees before placing the blocks
+			mm_sync();
+			async_room();
+			req_wait(req_submit_bulk(sizes+done, chunk, out+done), &response);
+			for (size_t i=done; i<done+chunk; i++) {
+				usable_record(out[i], sizes[i], 0);
+			}
+		} else {
+			chunk = 1;
+			out[done] = NULL;
+		}
+		// Blocks that did not fit take the single malloc path, which extends the heap
+		for (size_t i=done; i<done+chunk; i++) {
+			if (out[i] == NULL) {
+				out[i] = mm_malloc(sizes[i]);
+			}
+		}
+	}
+}
+
+// Malloc from the local region only, safe in interrupt handlers, NULL without room or a local region
+void *mm_malloc_local(size_t size)
+{
+	return LOCAL_HEAP ? local_malloc(size) : NULL;
+}
+
+// Take a block of at least size bytes from the interrupt handler pools, NULL when they are empty
+void *mm_isr_malloc(size_t size)
+{
+	return pool_malloc(size);
+}
+
+// Free ptr from an interrupt handler, queued until the next flush, returns 0 when the queue is full
+int mm_isr_free(void *ptr)
+{
+	return pool_free(ptr);
+}
+
+// Free what handlers queued and replace the pool blocks they took, in thread context
+void mm_isr_refill(void)
+{
+	mm_sync();
+	if (ISR_POOL_BLOCKS) {
+		pool_refill();
+	}
+}
+
+// Free count blocks at ptrs, queued to go out together
+void mm_free_bulk(size_t count, void ** ptrs)
+{
+	for (size_t i=0; i<count; i++) {
+		if (ptrs[i]) {
+			mm_free(ptrs[i]);
+		}
+	}
+}
+
+// Start a malloc of size bytes and return its handle right away, -1 when every handle is in use
+int mm_malloc_async(size_t size, mm_callback callback, void * arg) {
+	mm_async * a = async_alloc(callback, arg);
+	if (!a) {
+		return -1;
+	}
+	async_start(a, NULL, size);
+	return a - async_table;
+}
+
+// Start a realloc of ptr to size bytes and return its handle right away, -1 when every handle is in use
+int mm_realloc_async(void * ptr, size_t size, mm_callback callback, void * arg) {
+	mm_async * a = async_alloc(callback, arg);
+	if (!a) {
+		return -1;
+	}
+	async_start(a, ptr, size);
+	return a - async_table;
+}
+
+// Continue every async request whose response arrived, without waiting, returns 1 once handle is done
+int mm_poll(int handle) {
+	req_poll();
+	for (size_t i=0; i<ASYNC_HANDLES; i++) {
+		if (async_table[i].state == ASYNC_WAIT && req_done(async_table[i].slot)) {
+			async_step(&(async_table[i]));
+		}
+	}
+	return handle >= 0 && async_table[handle].state != ASYNC_WAIT;
+}
+
+// Wait for handle to finish, release it and return its result
+void * mm_await(int handle) {
+	void * result;
+	if (handle < 0 || async_table[handle].state == ASYNC_FREE) {
+		return NULL;
 	}
+	result = async_wait(&(async_table[handle]));
+	async_table[handle].state = ASYNC_FREE;
+	return result;
 }
 
 // Tell server to end session
 void mm_finish(void) {
+	mm_sync();
 	mem_request req = {.request=SBRK, .size=0, .ptr=0};
-	req_send(&req);
+	// The server exits on the end signal, make sure it arrived
+	req_send_sync(&req);
 }
@@ -6,4 +6,31 @@ extern void mm_finish(void); // End communication session
 // Standard malloc functions
 extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
+extern void mm_free_sized(void *ptr, size_t size); // Free ptr of a size byte block
 extern void *mm_realloc(void *ptr, size_t size);
+extern void *mm_memalign(size_t alignment, size_t size); // Malloc size bytes at a multiple of alignment
+extern size_t mm_malloc_usable_size(void *ptr); // Usable bytes of the block at ptr, at least its requested size
+extern void mm_malloc_bulk(size_t count, size_t * sizes, void ** out); // Malloc count blocks of sizes into out
+extern void mm_free_bulk(size_t count, void ** ptrs); // Free count blocks at ptrs
+extern void *mm_isr_malloc(size_t size); // Take a pool block of at least size bytes, safe in interrupt handlers, NULL when empty
+extern int mm_isr_free(void *ptr); // Free from an interrupt handler, queued for the next flush, returns 0 when the queue is full
+extern void mm_isr_refill(void); // Free queued handler frees and refill the pools, in thread context
+extern void *mm_malloc_local(size_t size); // Malloc from the local region, safe in interrupt handlers like mm_free of its blocks
+
+// Offloaded heap statistics, kept up to date by the server
+typedef struct mm_heap_stats {
+	size_t live_bytes; // Bytes in allocated blocks
+	size_t free_bytes; // Bytes in free blocks
+	size_t largest_free; // Largest free block
+	size_t fragmentation; // Free bytes outside the largest free block, in 1/1000 of the free bytes
+	size_t live_blocks;
+	size_t free_blocks;
+} mm_heap_stats;
+extern int mm_stats(mm_heap_stats * stats); // Ask the server for heap statistics, returns 0 on success, -1 when it has none
+
+// Async malloc functions, completed by mm_poll, mm_await or a callback
+typedef void (*mm_callback)(void * ptr, void * arg); // Result of an async request and the argument given with it
+extern int mm_malloc_async(size_t size, mm_callback callback, void * arg); // Start malloc, returns handle or -1
+extern int mm_realloc_async(void * ptr, size_t size, mm_callback callback, void * arg); // Start realloc, returns handle or -1
+extern int mm_poll(int handle); // Continue requests whose responses arrived, returns 1 once handle is done
+extern void * mm_await(int handle); // Wait for handle, release it and return its result
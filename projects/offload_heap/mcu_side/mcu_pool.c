@@ -0,0 +1,83 @@
+/*
+ * Fixed size block pools for interrupt handlers. Blocks come from the offloaded heap in thread context, ahead of
+ * time, so handlers never wait for the server. A handler takes a block by swapping its pool entry with NULL, and
+ * the refill only writes entries that are NULL, so neither side needs a lock or masked interrupts. Frees from
+ * handlers go into a queue the same way and are freed at the next flush.
+ */
+#include "mcu_pool.h"
+#include "mcu_mm.h"
+#include "uart_comms.h"
+
+static const size_t pool_sizes[] = ISR_POOL_SIZES;
+#define POOLS (sizeof(pool_sizes)/sizeof(size_t))
+
+// Blocks ready for handlers, NULL where one was taken
+static void * pool_blocks[POOLS][ISR_POOL_BLOCKS ? ISR_POOL_BLOCKS : 1];
+
+// Blocks freed by handlers, NULL where the entry is unused
+static void * isr_frees[ISR_FREE_QUEUE ? ISR_FREE_QUEUE : 1];
+
+// Take a block of the smallest pool holding size bytes that has one left, NULL when they are all taken
+void * pool_malloc(size_t size) {
+	void ** entry;
+	void * ptr;
+	for (size_t i=0; i<POOLS; i++) {
+		if (size > pool_sizes[i]) {
+			continue;
+		}
+		for (size_t j=0; j<ISR_POOL_BLOCKS; j++) {
+			entry = &(pool_blocks[i][j]);
+			// Another handler may take it between the check and the swap
+			if (__atomic_load_n(entry, __ATOMIC_RELAXED) && (ptr = __atomic_exchange_n(entry, NULL, __ATOMIC_ACQ_REL))) {
+				return ptr;
+			}
+		}
+	}
+	return NULL;
+}
+
+// Queue the free of ptr for the next flush, returns 0 when the queue is full
+int pool_free(void * ptr) {
+	void * empty;
+	for (size_t i=0; i<ISR_FREE_QUEUE; i++) {
+		empty = NULL;
+		if (__atomic_compare_exchange_n(&(isr_frees[i]), &empty, ptr, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Free the blocks handlers queued, in thread context
+void pool_drain(void) {
+	void * ptr;
+	for (size_t i=0; i<ISR_FREE_QUEUE; i++) {
+		if (__atomic_load_n(&(isr_frees[i]), __ATOMIC_RELAXED) && (ptr = __atomic_exchange_n(&(isr_frees[i]), NULL, __ATOMIC_ACQ_REL))) {
+			mm_free(ptr);
+		}
+	}
+}
+
+// Replace the pool blocks handlers took with one bulk malloc, in thread context
+void pool_refill(void) {
+	size_t sizes[POOLS*ISR_POOL_BLOCKS ? POOLS*ISR_POOL_BLOCKS : 1];
+	void * blocks[POOLS*ISR_POOL_BLOCKS ? POOLS*ISR_POOL_BLOCKS : 1];
+	void ** empty[POOLS*ISR_POOL_BLOCKS ? POOLS*ISR_POOL_BLOCKS : 1];
+	size_t count = 0;
+
+	for (size_t i=0; i<POOLS; i++) {
+		for (size_t j=0; j<ISR_POOL_BLOCKS; j++) {
+			// Handlers never fill an entry, an empty one stays empty until written here
+			if (!__atomic_load_n(&(pool_blocks[i][j]), __ATOMIC_ACQUIRE)) {
+				sizes[count] = pool_sizes[i];
+				empty[count++] = &(pool_blocks[i][j]);
+			}
+		}
+	}
+	if (count) {
+		mm_malloc_bulk(count, sizes, blocks);
+		for (size_t i=0; i<count; i++) {
+			__atomic_store_n(empty[i], blocks[i], __ATOMIC_RELEASE);
+		}
+	}
+}
@@ -0,0 +1,6 @@
+#include "mcu.h"
+
+void * pool_malloc(size_t size); // Take a pool block of at least size bytes, NULL when they are all taken
+int pool_free(void * ptr); // Queue the free of ptr, returns 0 when the queue is full
+void pool_drain(void); // Free the blocks queued by pool_free
+void pool_refill(void); // Replace the pool blocks that were taken
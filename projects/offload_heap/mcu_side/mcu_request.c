@@ -3,48 +3,514 @@
 
 #define READSIZE(buffer) *(size_t *)buffer
 
-// Temporary buffer for tx dma optimization
-static char tx_buffer[16] = {0};
+// Largest transfers: a full free queue of encoded requests, or a bulk malloc with its sizes
+#define QUEUE_BUFFERSIZE ((FREE_QUEUE_SIZE > 1 ? FREE_QUEUE_SIZE : 1)*CODEC_MAX_REQ)
+#define BULK_BUFFERSIZE (CODEC_MAX_REQ + BULK_MAX*CODEC_MAX_WORD)
+#define TX_BUFFERSIZE (QUEUE_BUFFERSIZE > BULK_BUFFERSIZE ? QUEUE_BUFFERSIZE : BULK_BUFFERSIZE)
 
-// Send size bytes at data pointer, using method defined by USE_DMA macro
-static void send(void * data, size_t size) {
+// Link layer state
+static uint8_t tx_seq = 0; // Sequence number of the next data frame sent
+static uint8_t tx_acked = 0; // Oldest data frame the server may not have received
+static uint8_t rx_seq = 0; // Sequence number of the next data frame expected
+static uint8_t tx_history[LINK_WINDOW][TX_BUFFERSIZE]; // Payloads of unacknowledged frames
+static size_t tx_history_len[LINK_WINDOW];
+static uint8_t rx_frame[FRAME_MAX]; // Last data frame received in sequence
+static size_t rx_pos = 0; // Next unread payload byte of rx_frame
+static size_t rx_len = 0; // Payload length of rx_frame
+static int link_up = 1; // Cleared when the server stops answering and the local region takes over
+
+// Request slot states
+#define SLOT_FREE 0 // Unused
+#define SLOT_SENT 1 // Request sent, response not yet received
+#define SLOT_DONE 2 // Response stored, waiting for req_wait
+
+// Malloc or realloc request in flight
+typedef struct {
+	uint8_t state;
+	uint8_t seq; // Data frame after the request's, the response acknowledges frames before it
+	uint8_t bulk; // Set for a bulk malloc, its response pointers go to out
+	uint32_t order; // Submission number, responses without ids arrive in this order
+	req_response response;
+	void ** out;
+	uint32_t * counts; // Set for a STATS request, its response counts go here
+	size_t count; // Pointers in a bulk malloc response
+} req_slot;
+
+static req_slot slots[REQ_SLOTS];
+static uint32_t submitted = 0; // Requests submitted so far
+static int responses = 0; // Set once the session is agreed, data frames then only carry slot responses
+static int usable = 0; // Set when responses carry usable sizes
+
+static void response_read(void);
+static void slot_fail(req_slot * slot);
+
+// Send a frame, using method defined by USE_DMA macro
+static void frame_send(uint8_t type, uint8_t seq, void * payload, size_t len) {
+	if (USE_DMA) {
+		uart_tx_frame_start(type, seq, payload, len);
+	} else {
+		uart_frame_send(type, seq, payload, len);
+	}
+}
+
+// Receive a frame, using method defined by USE_DMA macro
+static int frame_receive(uint8_t * frame, size_t timeout) {
 	if (USE_DMA) {
-		uart_tx_wait();
-		memcpy(tx_buffer, data, size);
-		uart_tx_start(tx_buffer, size);
+		// Queued frames keep going out while the response comes in
+		return uart_rx_frame(frame, timeout);
+	} else {
+		return uart_frame_receive(frame, timeout);
+	}
+}
+
+// Resend unacknowledged data frames starting at seq, asking for an ack on the last one
+static void link_resend(uint8_t seq) {
+	uint8_t index;
+	// Ignore requests for frames outside the window
+	if (SEQ_DIFF(seq, tx_acked) >= SEQ_DIFF(tx_seq, tx_acked)) {
+		return;
+	}
+	tx_acked = seq;
+	for (; seq != tx_seq; seq = (seq+1) & FRAME_SEQ_MASK) {
+		index = seq % LINK_WINDOW;
+		frame_send(((seq+1) & FRAME_SEQ_MASK) == tx_seq ? FRAME_DATA_ACKREQ : FRAME_DATA, seq, tx_history[index], tx_history_len[index]);
+	}
+}
+
+// Handle a valid frame, returns 1 when it was the next data frame
+static int link_handle(uint8_t * frame) {
+	switch (FRAME_TYPE(frame)) {
+		case FRAME_NACK:
+			link_resend(FRAME_SEQ(frame));
+			return 0;
+		case FRAME_ACK:
+			// Acknowledgement short of the last frame doubles as a resend request
+			if (FRAME_SEQ(frame) == tx_seq) {
+				tx_acked = tx_seq;
+			} else {
+				link_resend(FRAME_SEQ(frame));
+			}
+			return 0;
+	}
+	if (FRAME_SEQ(frame) != rx_seq) {
+		if (!SEQ_OLD(FRAME_SEQ(frame), rx_seq)) {
+			// Missed a frame
+			frame_send(FRAME_NACK, rx_seq, NULL, 0);
+		}
+		return 0;
+	}
+	rx_seq = (rx_seq+1) & FRAME_SEQ_MASK;
+	memcpy(rx_frame, frame, FRAME_LEN(frame)+FRAME_HEADER);
+	rx_pos = 0;
+	rx_len = FRAME_LEN(frame);
+	if (responses) {
+		// Store responses in their slots right away, frames arriving while sending would replace them
+		while (rx_pos < rx_len) {
+			response_read();
+		}
+	} else {
+		// Before the session starts every response follows all requests sent
+		tx_acked = tx_seq;
+	}
+	return 1;
+}
+
+// Give up on the server, requests waiting for it get NULL responses
+static void link_lost(void) {
+	link_up = 0;
+	for (size_t i=0; i<REQ_SLOTS; i++) {
+		if (slots[i].state == SLOT_SENT) {
+			slot_fail(&(slots[i]));
+		}
+	}
+}
+
+// Handle frames until a new data frame arrives (want_data) or all sent frames are acknowledged
+static void link_wait(int want_data) {
+	uint8_t frame[FRAME_MAX];
+	size_t retries = 0;
+	int received = 0;
+	while (link_up && (want_data ? (rx_pos == rx_len && !received) : (tx_acked != tx_seq))) {
+		switch (frame_receive(frame, LINK_TIMEOUT)) {
+			case FRAME_TIMEOUT:
+				// Request, ack or response lost: resend requests and ask for the response again
+				if (++retries > LINK_RETRIES) {
+					if (LOCAL_HEAP) {
+						// Carry on with the local region
+						link_lost();
+						return;
+					}
+					var_print("Link lost");
+					loop();
+				}
+				link_resend(tx_acked);
+				if (want_data) {
+					frame_send(FRAME_NACK, rx_seq, NULL, 0);
+				}
+				break;
+			case FRAME_CORRUPT:
+				frame_send(FRAME_NACK, rx_seq, NULL, 0);
+				break;
+			default:
+				received |= link_handle(frame);
+				break;
+		}
+	}
+}
+
+// Send size bytes at data pointer in a data frame, waiting for an ack when the window fills up or ack is set
+static void link_send(void * data, size_t size, int ack) {
+	uint8_t type = FRAME_DATA;
+	if (!link_up) {
+		return;
+	}
+	if (ack || SEQ_DIFF(tx_seq, tx_acked) >= LINK_WINDOW-1) {
+		type = FRAME_DATA_ACKREQ;
+	}
+	memcpy(tx_history[tx_seq % LINK_WINDOW], data, size);
+	tx_history_len[tx_seq % LINK_WINDOW] = size;
+	frame_send(type, tx_seq, data, size);
+	tx_seq = (tx_seq+1) & FRAME_SEQ_MASK;
+	if (type == FRAME_DATA_ACKREQ) {
+		link_wait(0);
+	}
+}
+
+// Copy size bytes of received payload into buffer, waiting for frames as needed
+static void link_receive(void * buffer, size_t size) {
+	size_t chunk;
+	while (size) {
+		link_wait(1);
+		if (!link_up) {
+			// Nothing more will arrive
+			memset(buffer, 0, size);
+			return;
+		}
+		chunk = (rx_len-rx_pos < size) ? (rx_len-rx_pos) : size;
+		memcpy(buffer, rx_frame+FRAME_HEADER+rx_pos, chunk);
+		rx_pos += chunk;
+		buffer = (uint8_t *)buffer + chunk;
+		size -= chunk;
+	}
+}
+
+// Send size bytes at data pointer, using method defined by USE_DMA and LINK_FRAMING macros
+static void send(void * data, size_t size) {
+	if (LINK_FRAMING) {
+		link_send(data, size, 0);
+	} else if (USE_DMA) {
+		// Copied into the transmit ring, the caller does not wait for the previous transfer
+		uart_tx_start(data, size);
 	} else {
 		uart_send(data, size);
 	}
 }
 
-// Receive size bytes at buffer pointer, using method defined by USE_DMA macro
+// Receive size bytes at buffer pointer, using method defined by USE_DMA and LINK_FRAMING macros
 static void receive(void * buffer, size_t size) {
-	if (USE_DMA) {
-		uart_tx_wait();
-		uart_rx_start(buffer, size);
-		uart_rx_wait();
+	if (LINK_FRAMING) {
+		link_receive(buffer, size);
+	} else if (USE_DMA) {
+		uart_rx_read(buffer, size);
 	} else {
 		uart_receive(buffer, size);
 	}
 }
 
+// Receive one encoded response word into buf
+static void receive_word(uint8_t * buf) {
+	size_t len = 0;
+	size_t need;
+	while ((need = codec_word_need(buf, len))) {
+		receive(buf+len, need);
+		len += need;
+	}
+}
+
+// Encode count requests into buf, returns encoded length
+static size_t encode(uint8_t * buf, mem_request * reqs, size_t count) {
+	size_t len = 0;
+	for (size_t i=0; i<count; i++) {
+		len += codec_req_encode(buf+len, reqs[i].request, reqs[i].size, (uint32_t)(uintptr_t)reqs[i].ptr, 0);
+	}
+	return len;
+}
+
 // Initialize request communication
 void mem_req_setup(void) {
 	mcu_init();
 	uart_init();
-	uart_dma_init();
+	if (USE_DMA) {
+		// Receive DMA takes every byte from here on
+		uart_dma_init();
+	}
 }
 
 // Send request
 void req_send(mem_request * buffer) {
+	req_send_batch(buffer, 1);
+}
+
+// Send count requests back to back as a single transfer
+void req_send_batch(mem_request * buffer, size_t count) {
+	uint8_t msg[TX_BUFFERSIZE];
+	led_on(GREEN);
+	send(msg, encode(msg, buffer, count));
+	led_off(GREEN);
+}
+
+// Send request and wait until the server acknowledged it and every request before it
+void req_send_sync(mem_request * buffer) {
+	uint8_t msg[CODEC_MAX_REQ];
+	size_t len = encode(msg, buffer, 1);
+	led_on(GREEN);
+	if (LINK_FRAMING) {
+		link_send(msg, len, 1);
+	} else {
+		send(msg, len);
+	}
+	led_off(GREEN);
+}
+
+// Wait for the start signal, returns 1 when it is correct
+int req_receive_start(void) {
+	uint8_t msg[CODEC_MAX_WORD];
+	size_t len = 1;
+	size_t need;
+	led_on(GREEN);
+	// 1 starts the signal in both encodings
+	receive(msg, 1);
+	if (LINK_FRAMING) {
+		// The signal has a frame of its own, drop whatever the server's encoding put after the first byte
+		rx_pos = rx_len;
+	} else {
+		// Without frames the server must use the same encoding
+		while ((need = codec_word_need(msg, len))) {
+			receive(msg+len, need);
+			len += need;
+		}
+	}
+	led_off(GREEN);
+	return msg[0] == 1 && (LINK_FRAMING || codec_ptr_decode(msg) == 1);
+}
+
+// Offer the options in hello to the server, replace them with the agreed ones and switch the codec to them
+void req_hello(codec_hello * hello) {
+	uint8_t msg[CODEC_HELLO_SIZE];
+	led_on(GREEN);
+	send(msg, codec_hello_encode(msg, hello));
+	receive(msg, CODEC_HELLO_SIZE);
+	codec_hello_decode(msg, hello);
+	codec_set_compact(hello->caps & CAP_COMPACT ? 1 : 0);
+	codec_set_ids(hello->caps & CAP_REQ_ID ? 1 : 0);
+	usable = hello->caps & CAP_USABLE ? 1 : 0;
+	responses = 1;
+	led_off(GREEN);
+}
+
+// Read one response and store it in the slot of the request it answers
+static void response_read(void) {
+	uint8_t msg[CODEC_MAX_WORD];
+	req_slot * slot = NULL;
+	uint32_t ptr, id, value;
+	if (codec_get_ids()) {
+		receive_word(msg);
+		id = codec_uint_decode(msg);
+		if (id < REQ_SLOTS && slots[id].state == SLOT_SENT) {
+			slot = &(slots[id]);
+		}
+	} else {
+		// Without ids the server answers in request order
+		for (size_t i=0; i<REQ_SLOTS; i++) {
+			if (slots[i].state == SLOT_SENT && (!slot || (int32_t)(slots[i].order - slot->order) < 0)) {
+				slot = &(slots[i]);
+			}
+		}
+	}
+	if (!slot) {
+		var_print("Response to no request");
+		loop();
+	}
+	if (slot->counts) {
+		for (size_t i=0; i<CODEC_STATS_WORDS; i++) {
+			receive_word(msg);
+			slot->counts[i] = codec_uint_decode(msg);
+		}
+	} else if (slot->bulk) {
+		// One pointer per requested block
+		for (size_t i=0; i<slot->count; i++) {
+			receive_word(msg);
+			slot->out[i] = (void *)(uintptr_t)codec_ptr_decode(msg);
+		}
+	} else {
+		receive_word(msg);
+		ptr = codec_ptr_decode(msg);
+		slot->response.count = 0;
+		slot->response.usable = 0;
+		if (usable && ptr) {
+			receive_word(msg);
+			codec_size_decode(msg, CODEC_MAX_WORD, &value);
+			slot->response.usable = value;
+		}
+		if (ptr & GRANT_FLAG) {
+			receive_word(msg);
+			slot->response.count = codec_uint_decode(msg);
+			if (slot->response.count > MAG_BLOCKS) {
+				var_print("Grant too large");
+				loop();
+			}
+			for (size_t i=0; i<slot->response.count; i++) {
+				receive_word(msg);
+				slot->response.blocks[i] = (void *)(uintptr_t)codec_ptr_decode(msg);
+			}
+		}
+		slot->response.ptr = (void *)(uintptr_t)(ptr & ~GRANT_FLAG);
+	}
+	slot->state = SLOT_DONE;
+	// The server read every frame up to the request's before answering it
+	if (LINK_FRAMING && SEQ_DIFF(slot->seq, tx_acked) <= SEQ_DIFF(tx_seq, tx_acked)) {
+		tx_acked = slot->seq;
+	}
+}
+
+// Receive the next response into its slot
+static void response_next(void) {
+	if (LINK_FRAMING) {
+		link_wait(1);
+	} else {
+		response_read();
+	}
+}
+
+// Store the responses that already arrived in their slots, without waiting for more
+void req_poll(void) {
+	uint8_t frame[FRAME_MAX];
+	while (link_up && (USE_DMA ? uart_rx_pending() : uart_rx_ready())) {
+		if (!LINK_FRAMING) {
+			response_read();
+		} else if (frame_receive(frame, LINK_TIMEOUT) == FRAME_OK) {
+			link_handle(frame);
+		} else {
+			// Damaged or cut short, ask for it again
+			frame_send(FRAME_NACK, rx_seq, NULL, 0);
+		}
+	}
+}
+
+// Returns 1 when every request slot is taken
+int req_full(void) {
+	for (size_t i=0; i<REQ_SLOTS; i++) {
+		if (slots[i].state == SLOT_FREE) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Take a free request slot for a request sent next, waiting for responses while every slot is in flight
+static size_t slot_take(void) {
+	size_t slot, sent;
+	while (1) {
+		sent = 0;
+		for (slot=0; slot<REQ_SLOTS && slots[slot].state != SLOT_FREE; slot++) {
+			sent += slots[slot].state == SLOT_SENT;
+		}
+		if (slot < REQ_SLOTS) {
+			break;
+		}
+		if (!sent) {
+			// Every response is stored but none was collected
+			var_print("No free request slot");
+			loop();
+		}
+		// Receiving a response lets its task collect it and release the slot
+		response_next();
+	}
+	// Mark the slot first, the response can arrive while the link waits for an ack
+	slots[slot].state = SLOT_SENT;
+	slots[slot].seq = (tx_seq+1) & FRAME_SEQ_MASK;
+	slots[slot].order = submitted++;
+	slots[slot].bulk = 0;
+	slots[slot].counts = NULL;
+	return slot;
+}
+
+// Send a malloc or realloc request, returns the slot its response arrives in
+int req_submit(mem_request * buffer) {
+	uint8_t msg[CODEC_MAX_REQ];
+	size_t slot = slot_take();
+	led_on(GREEN);
+	send(msg, codec_req_encode(msg, buffer->request, buffer->size, (uint32_t)(uintptr_t)buffer->ptr, slot));
+	led_off(GREEN);
+	if (!link_up) {
+		slot_fail(&(slots[slot]));
+	}
+	return slot;
+}
+
+// Send a bulk malloc of count (up to BULK_MAX) sizes in one transfer, returns the slot, the pointers go to out
+int req_submit_bulk(size_t * sizes, size_t count, void ** out) {
+	uint8_t msg[BULK_BUFFERSIZE];
+	size_t slot = slot_take();
+	size_t len;
+	slots[slot].bulk = 1;
+	slots[slot].out = out;
+	slots[slot].count = count;
+	led_on(GREEN);
+	len = codec_req_encode(msg, MALLOC_BULK, count, 0, slot);
+	for (size_t i=0; i<count; i++) {
+		len += codec_size_encode(msg+len, sizes[i]);
+	}
+	send(msg, len);
+	led_off(GREEN);
+	if (!link_up) {
+		slot_fail(&(slots[slot]));
+	}
+	return slot;
+}
+
+// Send a STATS request, returns the slot, the counts go to counts
+int req_submit_stats(uint32_t * counts) {
+	uint8_t msg[CODEC_MAX_REQ];
+	size_t slot = slot_take();
+	slots[slot].counts = counts;
 	led_on(GREEN);
-	send(buffer, sizeof(mem_request));
+	send(msg, codec_req_encode(msg, STATS, 0, 0, slot));
 	led_off(GREEN);
+	if (!link_up) {
+		slot_fail(&(slots[slot]));
+	}
+	return slot;
+}
+
+// Complete slot with a NULL response, the server will not answer it
+static void slot_fail(req_slot * slot) {
+	slot->response = (req_response){.ptr = NULL};
+	if (slot->counts) {
+		memset(slot->counts, 0, CODEC_STATS_WORDS*sizeof(uint32_t));
+	} else if (slot->bulk) {
+		memset(slot->out, 0, slot->count*sizeof(void *));
+	}
+	slot->state = SLOT_DONE;
+}
+
+// Returns 1 while the server answers, 0 once the link was lost
+int req_link_up(void) {
+	return link_up;
 }
 
-// Wait for response
-void req_receive(void ** buffer) {
+// Returns 1 once the response of slot arrived, without waiting
+int req_done(int slot) {
+	return slots[slot].state == SLOT_DONE;
+}
+
+// Wait for the response of slot, storing responses to other slots as they arrive, then copy it and release the slot
+void req_wait(int slot, req_response * response) {
 	led_on(GREEN);
-	receive(buffer, sizeof(void *));
+	while (slots[slot].state != SLOT_DONE) {
+		response_next();
+	}
+	*response = slots[slot].response;
+	slots[slot].state = SLOT_FREE;
 	led_off(GREEN);
 }
@@ -1,5 +1,24 @@
 #include "uart_dma.h"
 
+// Response to a malloc or realloc request
+typedef struct {
+	void * ptr; // Response pointer without flag bits
+	size_t usable; // Usable size of ptr, 0 when the server does not report it
+	size_t count; // Blocks of a magazine grant following a malloc response
+	void * blocks[MAG_BLOCKS];
+} req_response;
+
 void mem_req_setup(void); // Setup request communication
 void req_send(mem_request * buffer); // Send request
-void req_receive(void ** buffer); // Wait for request response
+void req_send_batch(mem_request * buffer, size_t count); // Send count requests in one transfer
+void req_send_sync(mem_request * buffer); // Send request and wait until the server acknowledged it
+int req_receive_start(void); // Wait for the start signal, returns 1 when it is correct
+void req_hello(codec_hello * hello); // Negotiate session options, hello holds the offer and receives the agreed options
+int req_submit(mem_request * buffer); // Send a malloc or realloc request, returns the slot its response arrives in
+int req_submit_bulk(size_t * sizes, size_t count, void ** out); // Send a bulk malloc, returns its slot, the pointers go to out once it is done
+int req_submit_stats(uint32_t * counts); // Send a STATS request, returns its slot, the CODEC_STATS_WORDS counts go to counts once it is done
+int req_link_up(void); // Returns 1 while the server answers, 0 once the link was lost (only with LINK_FRAMING and LOCAL_HEAP)
+int req_done(int slot); // Returns 1 once the response of slot arrived, without waiting
+void req_poll(void); // Store responses that already arrived in their slots, without waiting for more
+int req_full(void); // Returns 1 when every request slot is taken
+void req_wait(int slot, req_response * response); // Wait for the response of slot, copy it to response and release the slot
@@ -50,6 +50,61 @@ void SVC_Handler_Main(unsigned int * svc_args) {
 			svc_args[0] = get_time();
 			__set_CONTROL(__get_CONTROL() | CONTROL_nPRIV_Msk);
 			break;
+		case 6: // mm_malloc_async
+			__set_CONTROL(__get_CONTROL() & ~CONTROL_nPRIV_Msk);
+			svc_args[0] = (uint32_t)mm_malloc_async(svc_args[0], (mm_callback)svc_args[1], (void *)svc_args[2]);
+			__set_CONTROL(__get_CONTROL() | CONTROL_nPRIV_Msk);
+			break;
+		case 7: // mm_realloc_async
+			__set_CONTROL(__get_CONTROL() & ~CONTROL_nPRIV_Msk);
+			svc_args[0] = (uint32_t)mm_realloc_async((void *)svc_args[0], svc_args[1], (mm_callback)svc_args[2], (void *)svc_args[3]);
+			__set_CONTROL(__get_CONTROL() | CONTROL_nPRIV_Msk);
+			break;
+		case 8: // mm_poll
+			__set_CONTROL(__get_CONTROL() & ~CONTROL_nPRIV_Msk);
+			svc_args[0] = (uint32_t)mm_poll((int)svc_args[0]);
+			__set_CONTROL(__get_CONTROL() | CONTROL_nPRIV_Msk);
+			break;
+		case 9: // mm_await
+			__set_CONTROL(__get_CONTROL() & ~CONTROL_nPRIV_Msk);
+			svc_args[0] = (uint32_t)mm_await((int)svc_args[0]);
+			__set_CONTROL(__get_CONTROL() | CONTROL_nPRIV_Msk);
+			break;
+		case 10: // mm_malloc_bulk
+			__set_CONTROL(__get_CONTROL() & ~CONTROL_nPRIV_Msk);
+			mm_malloc_bulk(svc_args[0], (size_t *)svc_args[1], (void **)svc_args[2]);
+			__set_CONTROL(__get_CONTROL() | CONTROL_nPRIV_Msk);
+			break;
+		case 11: // mm_free_bulk
+			__set_CONTROL(__get_CONTROL() & ~CONTROL_nPRIV_Msk);
+			mm_free_bulk(svc_args[0], (void **)svc_args[1]);
+			__set_CONTROL(__get_CONTROL() | CONTROL_nPRIV_Msk);
+			break;
+		case 12: // mm_memalign
+			__set_CONTROL(__get_CONTROL() & ~CONTROL_nPRIV_Msk);
+			svc_args[0] = (uint32_t)mm_memalign(svc_args[0], svc_args[1]);
+			__set_CONTROL(__get_CONTROL() | CONTROL_nPRIV_Msk);
+			break;
+		case 13: // mm_malloc_usable_size
+			__set_CONTROL(__get_CONTROL() & ~CONTROL_nPRIV_Msk);
+			svc_args[0] = (uint32_t)mm_malloc_usable_size((void *)svc_args[0]);
+			__set_CONTROL(__get_CONTROL() | CONTROL_nPRIV_Msk);
+			break;
+		case 14: // mm_free_sized
+			__set_CONTROL(__get_CONTROL() & ~CONTROL_nPRIV_Msk);
+			mm_free_sized((void *)svc_args[0], svc_args[1]);
+			__set_CONTROL(__get_CONTROL() | CONTROL_nPRIV_Msk);
+			break;
+		case 15: // mm_stats
+			__set_CONTROL(__get_CONTROL() & ~CONTROL_nPRIV_Msk);
+			svc_args[0] = (uint32_t)mm_stats((mm_heap_stats *)svc_args[0]);
+			__set_CONTROL(__get_CONTROL() | CONTROL_nPRIV_Msk);
+			break;
+		case 16: // mm_isr_refill
+			__set_CONTROL(__get_CONTROL() & ~CONTROL_nPRIV_Msk);
+			mm_isr_refill();
+			__set_CONTROL(__get_CONTROL() | CONTROL_nPRIV_Msk);
+			break;
 		default:
 			break;
 	}
@@ -90,3 +145,72 @@ size_t sys_get_time(void) {
 	register uint32_t * ret_val asm("r0");
 	return (size_t) ret_val;
 }
+
+// Start a malloc of size bytes, callback (if not NULL) runs in the syscall that completes it
+int sys_malloc_async(size_t size, void (*callback)(void * ptr, void * arg), void * arg) {
+	asm volatile ("svc #6");
+	register uint32_t * ret_val asm("r0");
+	return (int) ret_val;
+}
+
+// Start a realloc of ptr to size bytes, callback (if not NULL) runs in the syscall that completes it
+int sys_realloc_async(void * ptr, size_t size, void (*callback)(void * ptr, void * arg), void * arg) {
+	asm volatile ("svc #7");
+	register uint32_t * ret_val asm("r0");
+	return (int) ret_val;
+}
+
+// Continue async requests whose responses arrived, returns 1 once handle is done
+int sys_mm_poll(int handle) {
+	asm volatile ("svc #8");
+	register uint32_t * ret_val asm("r0");
+	return (int) ret_val;
+}
+
+// Wait for handle to finish, release it and return its pointer
+void * sys_mm_await(int handle) {
+	asm volatile ("svc #9");
+	register uint32_t * ret_val asm("r0");
+	return (void *) ret_val;
+}
+
+// Allocate n blocks of sizes[i] bytes into out[i] with one server request per BULK_MAX blocks
+void sys_malloc_bulk(size_t n, size_t * sizes, void ** out) {
+	asm volatile ("svc #10");
+}
+
+// Free the n blocks at ptrs
+void sys_free_bulk(size_t n, void ** ptrs) {
+	asm volatile ("svc #11");
+}
+
+// Malloc size bytes at a multiple of alignment, for DMA buffers and MPU regions aligned to their size
+void * sys_memalign(size_t alignment, size_t size) {
+	asm volatile ("svc #12");
+	register uint32_t * ret_val asm("r0");
+	return (void *) ret_val;
+}
+
+// Usable size of the block at ptr, 0 when the server cannot report it
+size_t sys_malloc_usable_size(void * ptr) {
+	asm volatile ("svc #13");
+	register uint32_t * ret_val asm("r0");
+	return (size_t) ret_val;
+}
+
+// Free memory region at pointer that was allocated with size bytes
+void sys_free_sized(void * ptr, size_t size) {
+	asm volatile ("svc #14");
+}
+
+// Get live and free bytes, largest free block, fragmentation and block counts of the offloaded heap
+int sys_mm_stats(struct mm_heap_stats * stats) {
+	asm volatile ("svc #15");
+	register uint32_t * ret_val asm("r0");
+	return (int) ret_val;
+}
+
+// Free the blocks interrupt handlers freed with mm_isr_free and refill the pools mm_isr_malloc takes from
+void sys_mm_isr_refill(void) {
+	asm volatile ("svc #16");
+}
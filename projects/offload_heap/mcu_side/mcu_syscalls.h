@@ -2,9 +2,22 @@
 	#include <string.h>
 #endif
 
+struct mm_heap_stats; // Defined in mcu_mm.h
+
 void sys_mm_init(void); // Initialize malloc library
 void * sys_malloc(size_t size); // Allocate size bytes of memory and returns pointer
 void sys_free(void * ptr); // Free memory region at ptr
+void sys_free_sized(void * ptr, size_t size); // Free memory region at ptr allocated with size bytes, the server checks the size
 void * sys_realloc(void * ptr, size_t size); // Allocate size byte region with content of ptr, returns new pointer
+void sys_malloc_bulk(size_t n, size_t * sizes, void ** out); // Allocate n blocks of sizes[i] bytes into out[i], placed together by the server
+void sys_free_bulk(size_t n, void ** ptrs); // Free the n blocks at ptrs
+void * sys_memalign(size_t alignment, size_t size); // Allocate size bytes at a multiple of alignment (a power of 2), free with sys_free
+size_t sys_malloc_usable_size(void * ptr); // Bytes of the block at ptr that can be used, reallocs up to it need no server round trip
 void sys_mm_finish(void); // End communication with PC
+int sys_malloc_async(size_t size, void (*callback)(void * ptr, void * arg), void * arg); // Start malloc of size bytes, returns handle or -1
+int sys_realloc_async(void * ptr, size_t size, void (*callback)(void * ptr, void * arg), void * arg); // Start realloc of ptr, returns handle or -1
+int sys_mm_poll(int handle); // Continue async requests without waiting, returns 1 once handle is done (-1 only continues)
+void * sys_mm_await(int handle); // Wait for handle, release it and return its pointer
+int sys_mm_stats(struct mm_heap_stats * stats); // Get statistics of the offloaded heap, returns 0 on success
+void sys_mm_isr_refill(void); // Free blocks interrupt handlers freed and refill the pools they allocate from
 size_t sys_get_time(void); // Get current time in ms
@@ -3,6 +3,7 @@
  */
 
 #include "uart.h"
+#include "mcu_timer.h"
 
 char msg_buffer[BUFFERSIZE] = {0};
 
@@ -27,6 +28,48 @@ void uart_receive(void * buffer, size_t size)  {
 	}
 }
 
+// Returns 1 when a received byte is waiting to be read
+int uart_rx_ready(void) {
+	// RXNE bit
+	return (USART1->SR & (0x1U << 5)) ? 1 : 0;
+}
+
+// Receive one byte, return 0 if start+timeout ms passes first (timeout of 0 waits forever)
+static int uart_receive_byte(uint8_t * byte, size_t start, size_t timeout) {
+	// Wait until RXNE bit is set
+	while (!(USART1->SR & (0x1U << 5))) {
+		if (timeout && (get_time() - start > timeout)) {
+			return 0;
+		}
+	}
+	*byte = USART1->DR;
+	return 1;
+}
+
+// Send len bytes of payload in a frame
+void uart_frame_send(uint8_t type, uint8_t seq, void * payload, size_t len) {
+	uint8_t frame[FRAME_MAX];
+	uart_send(frame, frame_build(frame, type, seq, payload, len));
+}
+
+// Receive a frame into frame, skipping bytes until the sync byte
+int uart_frame_receive(uint8_t * frame, size_t timeout) {
+	size_t start = get_time();
+	// Hunt for sync byte
+	do {
+		if (!uart_receive_byte(&frame[0], start, timeout)) {
+			return FRAME_TIMEOUT;
+		}
+	} while (frame[0] != FRAME_SYNC);
+	// Header, then payload and CRC
+	for (size_t i=1; i<FRAME_HEADER || i<FRAME_LEN(frame)+FRAME_OVERHEAD; i++) {
+		if (!uart_receive_byte(&frame[i], start, timeout)) {
+			return FRAME_TIMEOUT;
+		}
+	}
+	return frame_check(frame) ? FRAME_OK : FRAME_CORRUPT;
+}
+
 // Setup GPIO B6 and B7 pins for UART
 static void uart_pin_setup(void) {
     // Enable GPIOB clock, bit 0 on AHB1ENR
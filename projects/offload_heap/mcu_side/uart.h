@@ -1,5 +1,6 @@
 #include "mcu.h"
 #include "uart_comms.h"
+#include "../shared_side/link_frame.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -13,3 +14,6 @@ void uart_init(void); // Initialize uart registers
 void uart_send(void * data, size_t size); // Send size bytes of data starting at data pointer
 void uart_receive(void * buffer, size_t size); // Receive size bytes of data and write to buffer
 void uart_wait_receive(void * buffer, size_t size); // Same as receive but stall until message is sent
+int uart_rx_ready(void); // Returns 1 when a received byte is waiting to be read
+void uart_frame_send(uint8_t type, uint8_t seq, void * payload, size_t len); // Send len bytes of payload in a frame
+int uart_frame_receive(uint8_t * frame, size_t timeout); // Receive a frame within timeout ms (0 waits forever), returns FRAME_OK, FRAME_TIMEOUT or FRAME_CORRUPT
@@ -1,10 +1,11 @@
 #include "../shared_side/shared_config.h"
+#include "../shared_side/req_codec.h"
 
 #include <stdint.h>
 
 // MCU to PC request struct
 typedef struct {
-	uint32_t request : 2; // Only 4 types
-	size_t size : 30; // Support up to 1GB request
+	uint32_t request : 4; // Up to 16 types
+	size_t size : 28; // Support up to 256MB request
 	void * ptr;
 } mem_request;
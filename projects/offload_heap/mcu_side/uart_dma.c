@@ -1,10 +1,18 @@
 #include "uart_dma.h"
+#include "mcu_timer.h"
 
-// DMA status indicators
-static int receiving=0;
-static int transmitting=0;
+// Bytes received by DMA2 Stream2, which runs in circular mode from uart_dma_init on
+static uint8_t rx_ring[RX_RING];
+static volatile size_t rx_head = 0; // Bytes received so far, the ring index is taken modulo RX_RING
+static size_t rx_tail = 0; // Bytes read so far
 
-// Setup uart transmission
+// Bytes queued for transmission, DMA sends them from tx_tail while new ones are added at tx_head
+static uint8_t tx_ring[TX_RING];
+static volatile size_t tx_head = 0; // Bytes queued so far, the ring index is taken modulo TX_RING
+static volatile size_t tx_tail = 0; // Bytes sent so far
+static volatile size_t tx_len = 0; // Bytes of the running transfer, 0 when the stream is idle
+
+// Setup uart transmission, done once: transfers only reload the address and count
 static void uart_tx_setup(void) {
 	// Clear control register
 	DMA2_Stream7->CR = 0;
@@ -20,93 +28,191 @@ static void uart_tx_setup(void) {
 	DMA2_Stream7->CR |= (0x2<<16);
 	// DIR bit set to 01: source SxM0AR, dest SxPAR
 	DMA2_Stream7->CR |= (0x1 << 6);
+	// Destination memory address
+	DMA2_Stream7->PAR = (uint32_t)&(USART1->DR);
+
+	// Enable transfer Complete interrupt
+	NVIC_SetPriority(DMA2_Stream7_IRQn, 4);
+	NVIC_EnableIRQ(DMA2_Stream7_IRQn);
 }
 
-// Setup uart reception
+// Start sending the queued bytes up to the end of the ring if the stream is idle, called with the stream's interrupt masked
+static void uart_tx_kick(void) {
+	size_t start = tx_tail % TX_RING;
+	size_t len = tx_head - tx_tail;
+	if (tx_len || !len) {
+		return;
+	}
+	if (len > TX_RING - start) {
+		// Rest goes once the transfer wraps
+		len = TX_RING - start;
+	}
+	tx_len = len;
+	// Clear flags of the last transfer, the stream does not start with them set
+	DMA2->HIFCR = DMA_HIFCR_CTCIF7 | DMA_HIFCR_CHTIF7 | DMA_HIFCR_CTEIF7 | DMA_HIFCR_CDMEIF7 | DMA_HIFCR_CFEIF7;
+	// Source memory address
+	DMA2_Stream7->M0AR = (uint32_t)&(tx_ring[start]);
+	// Transfer size
+	DMA2_Stream7->NDTR = len;
+	// Enable DMA
+	DMA2_Stream7->CR |= DMA_SxCR_EN;
+}
+
+// Setup uart reception once: circular transfers into rx_ring, interrupts at half, full and when the line goes idle
 static void uart_rx_setup(void) {
-	// Enable receive DMA
-	USART1->CR3 |= USART_CR3_DMAR;
 	// Clear control register
 	DMA2_Stream2->CR = 0;
 	// Wait for DMA to disable
 	while(DMA2_Stream2->CR & (1<<0));
 	// Select channel 4 for usart1_rx
 	DMA2_Stream2->CR |= (0x4<<25);
-	// Enable rx complete interrupt
-	DMA2_Stream2->CR |= DMA_SxCR_TCIE;
-	// Enable memory increment mode
-	DMA2_Stream2->CR |= DMA_SxCR_MINC;
+	// Enable half and full transfer interrupts, the ring's write position is read at each
+	DMA2_Stream2->CR |= DMA_SxCR_TCIE | DMA_SxCR_HTIE;
+	// Enable memory increment and circular mode
+	DMA2_Stream2->CR |= DMA_SxCR_MINC | DMA_SxCR_CIRC;
 	// Priority level high
 	DMA2_Stream2->CR |= (0x2<<16);
 	// DIR bit set to 00: source SxPAR, dest SxM0AR
 	DMA2_Stream2->CR &= ~(0xC << 6);
-}
-
-// Start uart transmission of size bytes of data
-void uart_tx_start(void * data, size_t size) {
-	uart_tx_wait();
-	uart_tx_setup();
-
 	// Source memory address
-	DMA2_Stream7->M0AR = (uint32_t)data;
+	DMA2_Stream2->PAR = (uint32_t)&(USART1->DR);
 	// Destination memory address
-	DMA2_Stream7->PAR = (uint32_t)&(USART1->DR);
-	// Transfer size
-	DMA2_Stream7->NDTR = size;
+	DMA2_Stream2->M0AR = (uint32_t)rx_ring;
+	// Transfer size, reloaded by the stream at every wrap
+	DMA2_Stream2->NDTR = RX_RING;
 
-	// Enable transfer Complete interrupt
-	NVIC_SetPriority(DMA2_Stream7_IRQn, 4);
-	NVIC_EnableIRQ(DMA2_Stream7_IRQn);
+	NVIC_SetPriority(DMA2_Stream2_IRQn, 5);
+	NVIC_EnableIRQ(DMA2_Stream2_IRQn);
+	// Line idle marks the end of a message
+	USART1->CR1 |= USART_CR1_IDLEIE;
+	NVIC_SetPriority(USART1_IRQn, 5);
+	NVIC_EnableIRQ(USART1_IRQn);
 
-	// Enable DMA
-	DMA2_Stream7->CR |= DMA_SxCR_EN;
+	// Enable receive DMA and leave it running
+	USART1->CR3 |= USART_CR3_DMAR;
+	DMA2_Stream2->CR |= DMA_SxCR_EN;
+}
 
-	transmitting=1;
+// Queue size bytes of data for transmission, returns once they are copied, waiting only for room in the ring
+void uart_tx_start(void * data, size_t size) {
+	size_t chunk, start;
+	while (size) {
+		// Wait for the stream to make room
+		while (tx_head - tx_tail == TX_RING);
+		start = tx_head % TX_RING;
+		chunk = TX_RING - (tx_head - tx_tail);
+		chunk = (chunk < size) ? chunk : size;
+		chunk = (chunk < TX_RING - start) ? chunk : TX_RING - start;
+		memcpy(&(tx_ring[start]), data, chunk);
+		data = (uint8_t *)data + chunk;
+		size -= chunk;
+
+		NVIC_DisableIRQ(DMA2_Stream7_IRQn);
+		tx_head += chunk;
+		uart_tx_kick();
+		NVIC_EnableIRQ(DMA2_Stream7_IRQn);
+	}
 }
 
-// Wait for uart transmission to finish
+// Wait for every queued byte to be sent
 void uart_tx_wait(void) {
-	while (transmitting);
+	while (tx_head != tx_tail);
 }
 
-// Start uart reception of size bytes of data into buffer
-void uart_rx_start(void * buffer, size_t size) {
-	uart_rx_wait();
-	uart_rx_setup();
-
-	// Source memory address
-	DMA2_Stream2->PAR = (uint32_t)&(USART1->DR);
-	// Destination memory address
-	DMA2_Stream2->M0AR = (uint32_t)buffer;
-	// Transfer size
-	DMA2_Stream2->NDTR = size;
+// Move rx_head up to the stream's write position, called from its interrupts or with them masked
+static void uart_rx_update(void) {
+	size_t pos = RX_RING - DMA2_Stream2->NDTR;
+	// Half and full transfer interrupts come before the stream moves a whole ring
+	rx_head += (pos - rx_head) & (RX_RING-1);
+}
 
-	// Enable transfer Complete interrupt
-	NVIC_SetPriority(DMA2_Stream2_IRQn, 5);
+// Bytes received and not yet read
+static size_t uart_rx_count(void) {
+	NVIC_DisableIRQ(DMA2_Stream2_IRQn);
+	NVIC_DisableIRQ(USART1_IRQn);
+	uart_rx_update();
+	NVIC_EnableIRQ(USART1_IRQn);
 	NVIC_EnableIRQ(DMA2_Stream2_IRQn);
+	if (rx_head - rx_tail > RX_RING) {
+		// Lapped: the unread bytes were overwritten, the link layer asks for them again
+		rx_tail = rx_head;
+	}
+	return rx_head - rx_tail;
+}
 
-	// Enable DMA
-	DMA2_Stream2->CR |= DMA_SxCR_EN;
+// Copy size received bytes into buffer, return 0 if start+timeout ms passes first (timeout of 0 waits forever)
+static int uart_rx_copy(uint8_t * buffer, size_t size, size_t start, size_t timeout) {
+	size_t chunk, index;
+	while (size) {
+		if (!(chunk = uart_rx_count())) {
+			if (timeout && (get_time() - start > timeout)) {
+				return 0;
+			}
+			continue;
+		}
+		index = rx_tail % RX_RING;
+		chunk = (chunk < size) ? chunk : size;
+		chunk = (chunk < RX_RING - index) ? chunk : RX_RING - index;
+		memcpy(buffer, &(rx_ring[index]), chunk);
+		rx_tail += chunk;
+		buffer += chunk;
+		size -= chunk;
+	}
+	return 1;
+}
+
+// Read size bytes of received data into buffer, waiting for them to arrive
+void uart_rx_read(void * buffer, size_t size) {
+	uart_rx_copy(buffer, size, 0, 0);
+}
 
-	receiving=1;
+// Returns 1 when received bytes are waiting to be read
+int uart_rx_pending(void) {
+	return uart_rx_count() != 0;
 }
 
-// Wait for uart reception to finish
-void uart_rx_wait(void) {
-	while (receiving);
+// Queue len bytes of payload in a frame for dma transmission
+void uart_tx_frame_start(uint8_t type, uint8_t seq, void * payload, size_t len) {
+	uint8_t frame[FRAME_MAX];
+	uart_tx_start(frame, frame_build(frame, type, seq, payload, len));
 }
 
-// UART reception finish interrupt
+// Receive a frame into frame from the receive ring, dropping bytes before the sync byte
+int uart_rx_frame(uint8_t * frame, size_t timeout) {
+	size_t start = get_time();
+
+	// Hunt for the sync byte
+	do {
+		if (!uart_rx_copy(frame, 1, start, timeout)) {
+			return FRAME_TIMEOUT;
+		}
+	} while (frame[0] != FRAME_SYNC);
+	// Header, then payload and CRC
+	if (!uart_rx_copy(frame+1, FRAME_HEADER-1, start, timeout) ||
+			!uart_rx_copy(frame+FRAME_HEADER, FRAME_LEN(frame)+FRAME_OVERHEAD-FRAME_HEADER, start, timeout)) {
+		return FRAME_TIMEOUT;
+	}
+	return frame_check(frame) ? FRAME_OK : FRAME_CORRUPT;
+}
+
+// UART reception half and full transfer interrupt
 void DMA2_Stream2_IRQHandler(void)
 {
-    // clear stream receive complete interrupt - bit11 for stream 5
-    if (DMA2->LISR & DMA_LISR_TCIF2) {
-        // clear interrupt
-        DMA2->LIFCR |= DMA_LISR_TCIF2;
-		receiving = 0;
-		// Disable receive DMA
-		USART1->CR3 &= ~USART_CR3_DMAR;
-    }
+	if (DMA2->LISR & (DMA_LISR_TCIF2 | DMA_LISR_HTIF2)) {
+		// clear interrupts
+		DMA2->LIFCR = DMA_LIFCR_CTCIF2 | DMA_LIFCR_CHTIF2;
+		uart_rx_update();
+	}
+}
+
+// UART line idle interrupt, the last byte of a message has landed
+void USART1_IRQHandler(void)
+{
+	if (USART1->SR & USART_SR_IDLE) {
+		// Reading SR then DR clears the flag, the DMA already took the data
+		(void)USART1->DR;
+		uart_rx_update();
+	}
 }
 
 // UART transmission finish interrupt
@@ -116,7 +222,10 @@ void DMA2_Stream7_IRQHandler(void)
     if (DMA2->HISR & DMA_HISR_TCIF7) {
         // clear interrupt
         DMA2->HIFCR |= DMA_HISR_TCIF7;
-		transmitting = 0;
+		// Send what was queued meanwhile, the stream keeps its setup
+		tx_tail += tx_len;
+		tx_len = 0;
+		uart_tx_kick();
     }
 }
 
@@ -124,10 +233,10 @@ void DMA2_Stream7_IRQHandler(void)
 void uart_dma_init(void) {
 	// Enable transmit DMA
 	USART1->CR3 |= USART_CR3_DMAT;
-	// Enable receive DMA
-	USART1->CR3 |= USART_CR3_DMAR;
 	// Clear TC bit
 	USART1->SR &= ~USART_SR_TC;
 	// Enable DMA2 clock
 	RCC->AHB1ENR |= RCC_AHB1ENR_DMA2EN;
+	uart_tx_setup();
+	uart_rx_setup();
 }
@@ -1,7 +1,9 @@
 #include "uart.h"
 
-void uart_tx_start(void * data, size_t size); // Start dma transmission
-void uart_tx_wait(void); // Wait for transmission to finish
-void uart_rx_start(void * buffer, size_t size); // Start dma reception
-void uart_rx_wait(void); // Wait for reception to finish
+void uart_tx_start(void * data, size_t size); // Queue data for dma transmission, data can be reused on return
+void uart_tx_wait(void); // Wait for every queued byte to be sent
+void uart_rx_read(void * buffer, size_t size); // Read size bytes from the dma receive ring, waiting for them to arrive
+int uart_rx_pending(void); // Returns 1 when received bytes wait in the ring
 void uart_dma_init(void); // Setup dma for UART
+void uart_tx_frame_start(uint8_t type, uint8_t seq, void * payload, size_t len); // Queue a frame for dma transmission
+int uart_rx_frame(uint8_t * frame, size_t timeout); // Receive a frame by dma within timeout ms (0 waits forever), returns FRAME_OK, FRAME_TIMEOUT or FRAME_CORRUPT
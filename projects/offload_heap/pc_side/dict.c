@@ -1,11 +1,9 @@
-#include "dict.h"
+#include "pc_heap.h"
+#include "pc_latency.h"
 #include <assert.h>
 
 #define START_COUNT 128
 
-// Dictionary used
-dict pointer_dict = {.count=0, .size=0, .table=NULL};
-
 // Hash function, returns hash key mod table size
 static uint32_t hash_func(uint32_t key) {
 	// FNV1a hash function
@@ -17,14 +15,14 @@ static uint32_t hash_func(uint32_t key) {
 		basis *= prime;
 	}
 
-	return key % pointer_dict.size;
+	return key % cur_heap->pointer_dict.size;
 }
 
 // Initialize dict
 void dict_create(void) {
-	pointer_dict.size = START_COUNT;
-	pointer_dict.count = 0;
-	pointer_dict.table = calloc(pointer_dict.size, sizeof(dict_elt));
+	cur_heap->pointer_dict.size = START_COUNT;
+	cur_heap->pointer_dict.count = 0;
+	cur_heap->pointer_dict.table = calloc(cur_heap->pointer_dict.size, sizeof(dict_elt));
 }
 
 // Insert entry with MCU pointer key and blk_elt * ptr
@@ -57,19 +55,19 @@ static void internal_dict_insert(dict_elt * table, uint32_t key, blk_elt * ptr)
 static void dict_double(void) {
 	dict_elt * cur_entry;
 	dict_elt * temp;
-	dict_elt * old_table = pointer_dict.table;
-	dict_elt * new_table = calloc(pointer_dict.size*2, sizeof(dict_elt));
-	size_t old_size = pointer_dict.size;
+	dict_elt * old_table = cur_heap->pointer_dict.table;
+	dict_elt * new_table = calloc(cur_heap->pointer_dict.size*2, sizeof(dict_elt));
+	size_t old_size = cur_heap->pointer_dict.size;
 
-	pointer_dict.size*=2;
+	cur_heap->pointer_dict.size*=2;
 
 	// Go through dict table
 	for (size_t i=0; i<old_size; i++) {
 		// Insert non-empty table entries to new dict
-		if (pointer_dict.table[i].key) {
-			internal_dict_insert(new_table, pointer_dict.table[i].key, pointer_dict.table[i].ptr);
+		if (cur_heap->pointer_dict.table[i].key) {
+			internal_dict_insert(new_table, cur_heap->pointer_dict.table[i].key, cur_heap->pointer_dict.table[i].ptr);
 		}
-		cur_entry = pointer_dict.table[i].next;
+		cur_entry = cur_heap->pointer_dict.table[i].next;
 		// Insert and free each parent before child
 		while (cur_entry) {
 			internal_dict_insert(new_table, cur_entry->key, cur_entry->ptr);
@@ -78,23 +76,25 @@ static void dict_double(void) {
 			free(temp);
 		}
 	}
-	pointer_dict.table = new_table;
+	cur_heap->pointer_dict.table = new_table;
 	free(old_table);
 }
 
 // Insert entry with MCU pointer key and blk_elt * ptr
 void dict_insert(uint32_t key, blk_elt * ptr) {
-	internal_dict_insert(pointer_dict.table, key, ptr);
-	pointer_dict.count++;
-	if (pointer_dict.count > pointer_dict.size) {
+	uint64_t start = lat_start();
+	internal_dict_insert(cur_heap->pointer_dict.table, key, ptr);
+	cur_heap->pointer_dict.count++;
+	if (cur_heap->pointer_dict.count > cur_heap->pointer_dict.size) {
 		dict_double();
 	}
+	lat_record(LAT_DICT, start);
 }
 
 // Search for MCU pointer key from dict, return NULL if not found
-blk_elt * dict_search(uint32_t key) {
+static blk_elt * internal_dict_search(uint32_t key) {
 	uint32_t index  = hash_func(key);
-	dict_elt * cur_entry = &(pointer_dict.table[index]);
+	dict_elt * cur_entry = &(cur_heap->pointer_dict.table[index]);
 	while (cur_entry) {
 		if (cur_entry->key == key) {
 			return cur_entry->ptr;
@@ -104,10 +104,19 @@ blk_elt * dict_search(uint32_t key) {
 	return NULL;
 }
 
+// Search for MCU pointer key from dict and record the time taken, return NULL if not found
+blk_elt * dict_search(uint32_t key) {
+	uint64_t start = lat_start();
+	blk_elt * blk = internal_dict_search(key);
+	lat_record(LAT_DICT, start);
+	return blk;
+}
+
 // Delete entry from dict 
 void dict_delete(uint32_t key) {
+	uint64_t start = lat_start();
 	uint32_t index  = hash_func(key);
-	dict_elt * cur_entry = &(pointer_dict.table[index]);
+	dict_elt * cur_entry = &(cur_heap->pointer_dict.table[index]);
 	dict_elt * prev_entry = NULL;
 	dict_elt * temp;
 	while (cur_entry) {
@@ -131,20 +140,21 @@ void dict_delete(uint32_t key) {
 					cur_entry->next = NULL;
 				}
 			}
-			pointer_dict.count--;
+			cur_heap->pointer_dict.count--;
 			break;
 		}
 		prev_entry = cur_entry;
 		cur_entry = cur_entry->next;
 	}
+	lat_record(LAT_DICT, start);
 }
 
 // Destroy dict and free all entries
 void dict_destroy(void) {
 	dict_elt * cur_entry;
 	dict_elt * temp;
-	for (size_t i=0; i<pointer_dict.size; i++) {
-		cur_entry = pointer_dict.table[i].next;
+	for (size_t i=0; i<cur_heap->pointer_dict.size; i++) {
+		cur_entry = cur_heap->pointer_dict.table[i].next;
 		// Free parent before each child
 		while (cur_entry) {
 			temp = cur_entry;
@@ -152,7 +162,7 @@ void dict_destroy(void) {
 			free(temp);
 		}
 	}
-	free(pointer_dict.table);
-	pointer_dict.count=0;
-	pointer_dict.size=0;
+	free(cur_heap->pointer_dict.table);
+	cur_heap->pointer_dict.count=0;
+	cur_heap->pointer_dict.size=0;
 }
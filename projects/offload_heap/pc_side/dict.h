@@ -19,6 +19,3 @@ void dict_insert(uint32_t key, blk_elt * ptr); // Insert entry with MCU pointer
 blk_elt * dict_search(uint32_t key); // Search for blk_elt pointer given MCU pointer key
 void dict_delete(uint32_t key); // Delete entry with key from dict
 void dict_destroy(void); // Free memory used by dict
-
-// Only one dictonary needed
-extern dict pointer_dict;
@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "pc_capture.h"
+#include "../shared_side/shared_config.h"
+
+static FILE * capture = NULL;
+static uint64_t last_time = 0; // Time of the previous record in us
+
+// Write value as a LEB128 varint
+static void put_varint(uint64_t value) {
+	while (value >= 0x80) {
+		fputc((value & 0x7F) | 0x80, capture);
+		value >>= 7;
+	}
+	fputc(value, capture);
+}
+
+// Start a record of kind with the time since the previous one
+static void put_record(uint8_t kind) {
+	struct timespec now;
+	uint64_t time;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	time = (uint64_t)now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+	put_varint(last_time ? time - last_time : 0);
+	last_time = time;
+	fputc(kind, capture);
+}
+
+// Create CAPTURE_FILE when CAPTURE_REQUESTS is set
+void capture_open(void) {
+	if (!CAPTURE_REQUESTS) {
+		return;
+	}
+	capture = fopen(CAPTURE_FILE, "wb");
+	if (!capture) {
+		perror(CAPTURE_FILE);
+		return;
+	}
+	fputs(CAPTURE_MAGIC, capture);
+}
+
+// Log a received request
+void capture_request(uint32_t request, uint32_t size, uint32_t ptr) {
+	if (capture) {
+		put_record(request);
+		put_varint(size);
+		put_varint(ptr);
+	}
+}
+
+// Log a malloc or realloc response
+void capture_response(uint32_t ptr) {
+	if (capture) {
+		put_record(CAPTURE_RESPONSE);
+		put_varint(ptr);
+	}
+}
+
+// Log a magazine grant of size byte blocks
+void capture_grant(uint32_t size, uint32_t * blocks, size_t count) {
+	if (capture) {
+		put_record(CAPTURE_GRANT);
+		put_varint(size);
+		put_varint(count);
+		for (size_t i=0; i<count; i++) {
+			put_varint(blocks[i]);
+		}
+	}
+}
+
+// Flush and close the capture file
+void capture_close(void) {
+	if (capture) {
+		fclose(capture);
+		capture = NULL;
+	}
+}
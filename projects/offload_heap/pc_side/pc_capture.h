@@ -0,0 +1,15 @@
+#include <stdint.h>
+#include <stddef.h>
+
+// Capture file: CAPTURE_MAGIC, then records of a varint time in us since the previous record and a kind byte.
+// Request kinds (MALLOC to MAG_USED) are followed by varint size and ptr, CAPTURE_RESPONSE by a varint pointer and
+// CAPTURE_GRANT by varint size, count and count block pointers. Varints are LEB128.
+#define CAPTURE_MAGIC "OHCAP1"
+#define CAPTURE_RESPONSE 0x10 // Malloc or realloc response pointer, grant flag cleared
+#define CAPTURE_GRANT 0x11 // Magazine blocks granted with the last malloc response
+
+void capture_open(void); // Create CAPTURE_FILE when CAPTURE_REQUESTS is set
+void capture_request(uint32_t request, uint32_t size, uint32_t ptr); // Log a received request
+void capture_response(uint32_t ptr); // Log a malloc or realloc response
+void capture_grant(uint32_t size, uint32_t * blocks, size_t count); // Log a magazine grant of size byte blocks
+void capture_close(void); // Flush and close the capture file
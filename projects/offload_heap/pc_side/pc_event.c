@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/epoll.h>
+
+#include "pc_event.h"
+
+// Most event sources and ready events handled per wakeup
+#define MAX_SOURCES 8
+
+// Registered file descriptor
+typedef struct {
+	int fd;
+	event_handler handler;
+} event_source;
+
+static int epoll_fd = -1;
+static event_source sources[MAX_SOURCES];
+static size_t source_count = 0;
+
+// Create the epoll instance
+void event_init(void) {
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		perror("epoll_create1");
+		exit(1);
+	}
+}
+
+// Call handler whenever fd is readable
+void event_add(int fd, event_handler handler) {
+	struct epoll_event event = {.events = EPOLLIN};
+	assert(source_count < MAX_SOURCES);
+	sources[source_count] = (event_source){.fd = fd, .handler = handler};
+	event.data.ptr = &(sources[source_count++]);
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+		perror("epoll_ctl");
+		exit(1);
+	}
+}
+
+// Wait up to timeout ms (-1 forever) and call the handlers of readable fds
+void event_dispatch(int timeout) {
+	struct epoll_event events[MAX_SOURCES];
+	event_source * source;
+	int ready = epoll_wait(epoll_fd, events, MAX_SOURCES, timeout);
+	if (ready < 0 && errno != EINTR) {
+		perror("epoll_wait");
+		exit(1);
+	}
+	for (int i=0; i<ready; i++) {
+		source = events[i].data.ptr;
+		source->handler(source->fd);
+	}
+}
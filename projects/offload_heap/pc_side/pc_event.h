@@ -0,0 +1,5 @@
+typedef void (*event_handler)(int fd); // Called when fd is readable
+
+void event_init(void); // Create the epoll instance
+void event_add(int fd, event_handler handler); // Call handler whenever fd is readable
+void event_dispatch(int timeout); // Wait up to timeout ms (-1 forever) and call the handlers of readable fds
@@ -0,0 +1,29 @@
+#include "dict.h"
+
+// Number of size classes
+#define SIZE_CLASSES 12
+
+// State of one allocator instance, the server's heap mirror or a shadow allocator
+typedef struct {
+	/* 
+	 * Class table: first 8 classes are 1-8 words.
+	 * Later classe sizes are 2*prev_class_size.
+	 * Each class include blocks greater than its size but smaller than
+	 * next class size.
+	 * Starting block in array has size 0.
+	 */
+	blk_elt class_table[SIZE_CLASSES];
+	blk_elt * list_start; // Pointer to first block
+	dict pointer_dict; // MCU pointer to block lookup
+	uint32_t mem_start_brk; // First byte of heap
+	uint32_t mem_brk; // Last byte of heap
+	int search_opt; // Fit policy, FIRST_FIT, BEST_FIT or SEG_FIT
+	size_t live_bytes; // Bytes in allocated blocks, kept up to date for mm_stats
+	size_t live_blocks; // Allocated blocks, the rest of the dict's blocks are free
+	blk_elt ** size_queue; // Free blocks as a binary max heap by size, the first is the largest for mm_stats
+	size_t size_queue_count; // Free blocks in the size queue
+	size_t size_queue_cap; // Entries allocated for the size queue
+} heap_instance;
+
+// Instance the allocator functions work on, per thread so shadows run beside the server
+extern _Thread_local heap_instance * cur_heap;
@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "pc_latency.h"
+#include "../shared_side/shared_config.h"
+
+// Log-linear buckets: values below 2^SUB_BITS are exact, above that each power of two is split into 2^(SUB_BITS-1)
+// linear sub-buckets, so reported values are within about 6% of the recorded ones
+#define SUB_BITS 5
+#define MAX_BITS 40 // Values are clamped to 2^MAX_BITS ns (about 18 minutes)
+#define BUCKETS ((MAX_BITS-SUB_BITS+2) << (SUB_BITS-1))
+
+// One latency histogram
+typedef struct {
+	uint64_t counts[BUCKETS];
+	uint64_t total; // Number of values recorded
+	uint64_t sum; // Sum of values for the mean
+	uint64_t max;
+} histogram;
+
+static histogram hists[LAT_COUNT];
+
+// Set in threads whose allocator calls should not be recorded
+static _Thread_local int disabled = 0;
+
+static const char * hist_names[LAT_COUNT] = {"malloc", "free", "realloc", "sbrk", "find_fit", "coalesce", "dict"};
+
+// Bucket holding value
+static size_t bucket_index(uint64_t value) {
+	size_t shift;
+	if (value >= (1ULL << MAX_BITS)) {
+		value = (1ULL << MAX_BITS) - 1;
+	}
+	if (value < (1ULL << SUB_BITS)) {
+		return value;
+	}
+	shift = 63 - __builtin_clzll(value) - SUB_BITS + 1;
+	return (shift << (SUB_BITS-1)) + (value >> shift);
+}
+
+// Largest value that lands in bucket index
+static uint64_t bucket_value(size_t index) {
+	size_t shift;
+	if (index < (1U << SUB_BITS)) {
+		return index;
+	}
+	shift = (index >> (SUB_BITS-1)) - 1;
+	return ((uint64_t)(index - (shift << (SUB_BITS-1)) + 1) << shift) - 1;
+}
+
+// Value at quantile q of hist
+static uint64_t hist_quantile(histogram * hist, double q) {
+	uint64_t target = (uint64_t)(q * hist->total + 0.5);
+	uint64_t seen = 0;
+	if (target == 0) {
+		target = 1;
+	}
+	for (size_t i=0; i<BUCKETS; i++) {
+		seen += hist->counts[i];
+		if (seen >= target) {
+			// Bucket bound can overshoot the largest value recorded
+			return bucket_value(i) < hist->max ? bucket_value(i) : hist->max;
+		}
+	}
+	return hist->max;
+}
+
+// Current monotonic time in ns, 0 when LATENCY_STATS is off or the thread is disabled
+uint64_t lat_start(void) {
+	struct timespec now;
+	if (!LATENCY_STATS || disabled) {
+		return 0;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Record time since start into hist
+void lat_record(lat_hist hist, uint64_t start) {
+	uint64_t value;
+	if (!LATENCY_STATS || disabled) {
+		return;
+	}
+	value = lat_start() - start;
+	hists[hist].counts[bucket_index(value)]++;
+	hists[hist].total++;
+	hists[hist].sum += value;
+	if (value > hists[hist].max) {
+		hists[hist].max = value;
+	}
+}
+
+// Record time since start for a request type
+void lat_request(uint32_t request, uint64_t start) {
+	if (request == FREE_SIZED) {
+		request = FREE;
+	}
+	if (request <= SBRK) {
+		lat_record((lat_hist)request, start);
+	}
+}
+
+// Stop recording in the calling thread, the histograms are not thread safe
+void lat_disable(void) {
+	disabled = 1;
+}
+
+// Print p50/p99/p999/max of each histogram and write them to LATENCY_FILE
+void lat_report(void) {
+	FILE * file;
+	histogram * hist;
+	if (!LATENCY_STATS) {
+		return;
+	}
+	file = fopen(LATENCY_FILE, "w");
+	if (file) {
+		fprintf(file, "histogram,count,mean_ns,p50_ns,p99_ns,p999_ns,max_ns\n");
+	}
+	printf("%-10s %10s %10s %10s %10s %10s %10s\n", "latency", "count", "mean ns", "p50 ns", "p99 ns", "p999 ns", "max ns");
+	for (size_t i=0; i<LAT_COUNT; i++) {
+		hist = &(hists[i]);
+		if (!hist->total) {
+			continue;
+		}
+		printf("%-10s %10llu %10llu %10llu %10llu %10llu %10llu\n", hist_names[i],
+				(unsigned long long)hist->total, (unsigned long long)(hist->sum/hist->total),
+				(unsigned long long)hist_quantile(hist, 0.5), (unsigned long long)hist_quantile(hist, 0.99),
+				(unsigned long long)hist_quantile(hist, 0.999), (unsigned long long)hist->max);
+		if (file) {
+			fprintf(file, "%s,%llu,%llu,%llu,%llu,%llu,%llu\n", hist_names[i],
+					(unsigned long long)hist->total, (unsigned long long)(hist->sum/hist->total),
+					(unsigned long long)hist_quantile(hist, 0.5), (unsigned long long)hist_quantile(hist, 0.99),
+					(unsigned long long)hist_quantile(hist, 0.999), (unsigned long long)hist->max);
+		}
+	}
+	if (file) {
+		fclose(file);
+	}
+}
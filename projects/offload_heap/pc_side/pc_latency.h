@@ -0,0 +1,19 @@
+#include <stdint.h>
+
+// Latency histograms, the first four match the request types
+typedef enum {
+	LAT_MALLOC,
+	LAT_FREE,
+	LAT_REALLOC,
+	LAT_SBRK,
+	LAT_FIND_FIT,
+	LAT_COALESCE,
+	LAT_DICT,
+	LAT_COUNT
+} lat_hist;
+
+uint64_t lat_start(void); // Current monotonic time in ns, 0 when LATENCY_STATS is off or the thread is disabled
+void lat_record(lat_hist hist, uint64_t start); // Record time since start into hist
+void lat_request(uint32_t request, uint64_t start); // Record time since start for a request type
+void lat_disable(void); // Stop recording in the calling thread
+void lat_report(void); // Print p50/p99/p999/max of each histogram and write them to LATENCY_FILE
@@ -0,0 +1,81 @@
+#include "pc_magazine.h"
+#include "pc_mm.h"
+#include "../shared_side/shared_config.h"
+
+// Blocks granted to the MCU for one request size
+typedef struct {
+	uint32_t size; // Request size, 0 when unused
+	uint32_t outstanding; // Granted blocks not yet reported as used
+} mag_elt;
+
+// Malloc count of each request size up to MAG_MAX_SIZE
+static uint32_t size_histogram[MAG_MAX_SIZE+1] = {0};
+
+// Mirrors the magazine slots held by the MCU
+static mag_elt mag_table[MAG_CLASSES] = {0};
+
+// Return magazine slot for size, NULL if none
+static mag_elt * mag_search(uint32_t size) {
+	for (size_t i=0; i<MAG_CLASSES; i++) {
+		if (mag_table[i].size == size) {
+			return &(mag_table[i]);
+		}
+	}
+	return NULL;
+}
+
+// Reset size histogram and magazine table
+void mag_init(void) {
+	memset(size_histogram, 0, sizeof(size_histogram));
+	memset(mag_table, 0, sizeof(mag_table));
+}
+
+// Count a malloc of size bytes
+void mag_record(uint32_t size) {
+	if (size <= MAG_MAX_SIZE) {
+		size_histogram[size]++;
+	}
+}
+
+// Allocate up to MAG_BLOCKS blocks of size bytes if size is hot and a slot is free, returns block count
+size_t mag_grant(uint32_t size, uint32_t * blocks) {
+	mag_elt * slot;
+	size_t count = 0;
+
+	// Only frequently requested sizes get magazines
+	if (size > MAG_MAX_SIZE || size_histogram[size] < MAG_THRESHOLD) {
+		return 0;
+	}
+	// MCU still holds blocks of this size, or has no free slot
+	if (mag_search(size) || !(slot = mag_search(0))) {
+		return 0;
+	}
+
+	// Fill from existing free blocks only, never extend the heap for a grant
+	while (count < MAG_BLOCKS && (blocks[count] = mm_malloc(size))) {
+		count++;
+	}
+	if (count) {
+		slot->size = size;
+		slot->outstanding = count;
+	}
+	return count;
+}
+
+// MCU handed out count blocks of the size magazine, release slot once all are used
+void mag_used(uint32_t size, uint32_t count) {
+	mag_elt * slot = mag_search(size);
+	if (!slot || size == 0) {
+		printf("Magazine of size %u not found\n", size);
+		return;
+	}
+	if (count > slot->outstanding) {
+		// The mcu disagrees with the grant, treat every block as used
+		printf("Magazine of size %u used %u blocks, %u were granted\n", size, count, slot->outstanding);
+		count = slot->outstanding;
+	}
+	slot->outstanding -= count;
+	if (slot->outstanding == 0) {
+		slot->size = 0;
+	}
+}
@@ -0,0 +1,6 @@
+#include "memlib.h"
+
+void mag_init(void); // Reset size histogram and magazine table
+void mag_record(uint32_t size); // Count a malloc of size bytes in the histogram
+size_t mag_grant(uint32_t size, uint32_t * blocks); // Allocate a magazine of size byte blocks into blocks, returns block count
+void mag_used(uint32_t size, uint32_t count); // MCU reported count blocks of the size magazine as handed out
@@ -12,14 +12,12 @@
 
 #include "memlib.h"
 #include "pc_request.h"
-#include "pc_mm.h"
+#include "pc_heap.h"
 
 #define ALIGNMENT 4
 #define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~0x7)
 
-/* private variables */
-static uint32_t mem_start_brk;  /* points to first byte of heap */
-static uint32_t mem_brk;        /* points to last byte of heap */
+/* private variables are kept in cur_heap */
 //static char *mem_max_addr;   /* largest legal heap address */ 
 
 /* 
@@ -27,7 +25,7 @@ static uint32_t mem_brk;        /* points to last byte of heap */
  */
 void mem_deinit(void)
 {
-	mem_reset_brk(mem_start_brk);
+	mem_reset_brk(cur_heap->mem_start_brk);
 }
 
 /*
@@ -35,7 +33,7 @@ void mem_deinit(void)
  */
 void mem_reset_brk(uint32_t ptr)
 {
-    mem_brk = mem_start_brk = ptr;
+    cur_heap->mem_brk = cur_heap->mem_start_brk = ptr;
 }
 
 /* 
@@ -46,8 +44,8 @@ void mem_reset_brk(uint32_t ptr)
 // Only changes local variable, all sbrk requests need to be initiated by the MCU
 uint32_t mem_sbrk(int incr) 
 {
-    uint32_t old_brk = mem_brk;
-    mem_brk += incr;
+    uint32_t old_brk = cur_heap->mem_brk;
+    cur_heap->mem_brk += incr;
 
 	mm_sbrk(incr);
 
@@ -56,7 +54,7 @@ uint32_t mem_sbrk(int incr)
 
 // Set sbrk to a specific pointer
 void mem_set_brk(uint32_t ptr) {
-	mem_brk = ptr;
+	cur_heap->mem_brk = ptr;
 }
 
 /*
@@ -64,7 +62,7 @@ void mem_set_brk(uint32_t ptr) {
  */
 uint32_t mem_heap_lo()
 {
-    return mem_start_brk;
+    return cur_heap->mem_start_brk;
 }
 
 /* 
@@ -72,7 +70,7 @@ uint32_t mem_heap_lo()
  */
 uint32_t mem_heap_hi()
 {
-    return (mem_brk - 1);
+    return (cur_heap->mem_brk - 1);
 }
 
 /*
@@ -80,7 +78,7 @@ uint32_t mem_heap_hi()
  */
 size_t mem_heapsize() 
 {
-    return (size_t)(mem_brk - mem_start_brk);
+    return (size_t)(cur_heap->mem_brk - cur_heap->mem_start_brk);
 }
 
 /*
@@ -1,5 +1,6 @@
-#include "dict.h"
+#include "pc_heap.h"
 #include "memlib.h"
+#include "pc_latency.h"
 #include "../shared_side/shared_config.h"
 #include <assert.h>
 
@@ -15,20 +16,11 @@
 
 #define MAX(x,y) ((x) > (y) ? (x) : (y))
 
-// Number of size classes
-#define SIZE_CLASSES 12
+// Heap mirroring the MCU's
+static heap_instance primary = {.search_opt = SEARCH_OPT};
 
-/* 
- * Class table: first 8 classes are 1-8 words.
- * Later classe sizes are 2*prev_class_size.
- * Each class include blocks greater than its size but smaller than
- * next class size.
- * Starting block in array has size 0.
- */
-static blk_elt class_table[SIZE_CLASSES] = {0};
-
-// Pointer to first block
-static blk_elt * list_start = NULL;
+// Heap the server answers requests from unless a thread selects another
+_Thread_local heap_instance * cur_heap = &primary;
 
 // Returns the index of size in class table
 size_t class_index(uint32_t size) {
@@ -53,9 +45,63 @@ size_t class_index(uint32_t size) {
 	return 0;
 }
 
+// Swap entries i and j of the size queue
+static void size_queue_swap(size_t i, size_t j) {
+	blk_elt ** queue = cur_heap->size_queue;
+	blk_elt * temp = queue[i];
+	queue[i] = queue[j];
+	queue[j] = temp;
+	queue[i]->size_pos = i;
+	queue[j]->size_pos = j;
+}
+
+// Move size queue entry i up or down until the queue is in order again
+static void size_queue_fix(size_t i) {
+	blk_elt ** queue = cur_heap->size_queue;
+	size_t child;
+	// Up while larger than its parent
+	while (i && queue[i]->size > queue[(i-1)/2]->size) {
+		size_queue_swap(i, (i-1)/2);
+		i = (i-1)/2;
+	}
+	// Down while a child is larger
+	while ((child = 2*i+1) < cur_heap->size_queue_count) {
+		if (child+1 < cur_heap->size_queue_count && queue[child+1]->size > queue[child]->size) {
+			child++;
+		}
+		if (queue[child]->size <= queue[i]->size) {
+			break;
+		}
+		size_queue_swap(i, child);
+		i = child;
+	}
+}
+
+// Add free blk to the size queue
+static void size_queue_add(blk_elt * blk) {
+	if (cur_heap->size_queue_count == cur_heap->size_queue_cap) {
+		cur_heap->size_queue_cap = cur_heap->size_queue_cap ? 2*cur_heap->size_queue_cap : 64;
+		cur_heap->size_queue = realloc(cur_heap->size_queue, cur_heap->size_queue_cap*sizeof(blk_elt *));
+	}
+	blk->size_pos = cur_heap->size_queue_count++;
+	cur_heap->size_queue[blk->size_pos] = blk;
+	size_queue_fix(blk->size_pos);
+}
+
+// Remove free blk from the size queue, the last entry takes its place
+static void size_queue_remove(blk_elt * blk) {
+	size_t pos = blk->size_pos;
+	size_t last = --cur_heap->size_queue_count;
+	if (pos != last) {
+		size_queue_swap(pos, last);
+		size_queue_fix(pos);
+	}
+}
+
 // Remove a free block from its class list
 void free_blk_remove(blk_elt * blk) {
 	if (SEG_FIT) {
+		size_queue_remove(blk);
 		blk->prev_free->next_free = blk->next_free;
 		blk->next_free->prev_free = blk->prev_free;
 		// Might help with debugging
@@ -69,18 +115,29 @@ void free_blk_add(blk_elt * blk) {
 	if (SEG_FIT) {
 		size_t index = class_index(blk->size);
 		assert(!blk->alloc);
+		size_queue_add(blk);
 		// Set prev and next of blk
-		blk->next_free = class_table[index].next_free;
-		blk->prev_free = &(class_table[index]);
+		blk->next_free = cur_heap->class_table[index].next_free;
+		blk->prev_free = &(cur_heap->class_table[index]);
 		// Set prev and next of adjacent blocks
 		blk->prev_free->next_free = blk;
 		blk->next_free->prev_free = blk;
 	}
 }
 
+// Move free blk to its class list and size queue place after its size changed from old_size
+static void free_blk_resize(blk_elt * blk, size_t old_size) {
+	if (class_index(old_size) != class_index(blk->size)) {
+		free_blk_remove(blk);
+		free_blk_add(blk);
+	} else {
+		size_queue_fix(blk->size_pos);
+	}
+}
+
 // Look through linked list for block pointer, return 0 when not found
 static inline blk_elt * linear_blk_search(uint32_t ptr) {
-	blk_elt * search_blk = list_start->next;
+	blk_elt * search_blk = cur_heap->list_start->next;
 	while (search_blk->size) {
 		if (search_blk->ptr == ptr) {
 			return search_blk;
@@ -119,14 +176,12 @@ static blk_elt * merge_next(blk_elt * blk) {
 }
 
 // Coalesce free blocks with adjacent free blocks, return pointer to coalesced free block
-static void coalesce(blk_elt * blk) {
+static void coalesce_blks(blk_elt * blk) {
 	// Alloc bit of prev and next block
 	size_t prev_alloc = blk->prev->alloc;
 	size_t next_alloc = blk->next->alloc;
-	// Current block size
-	size_t size = blk->size;
-	// Old class index
-	size_t old_index;
+	// Old size of the block that stays
+	size_t old_size;
 	// Temporary buffer - stores remaining free block
 	blk_elt * temp;
 
@@ -136,38 +191,29 @@ static void coalesce(blk_elt * blk) {
 	} else if (prev_alloc && !next_alloc) {
 		// Coalesce with next block
 		temp = blk;
-		old_index = class_index(temp->size);
+		old_size = temp->size;
 		merge_next(blk);
-		if (old_index != class_index(temp->size)) {
-			free_blk_remove(temp);
-			free_blk_add(temp);
-		}
+		free_blk_resize(temp, old_size);
 	} else if (!prev_alloc && next_alloc) {
 		// Coalesce with previous block
 		temp = blk->prev;
-		old_index = class_index(temp->size);
+		old_size = temp->size;
 		merge_next(blk->prev);
-		if (old_index != class_index(temp->size)) {
-			free_blk_remove(temp);
-			free_blk_add(temp);
-		}
+		free_blk_resize(temp, old_size);
 	} else {
 		// Both blocks are free
 		temp = blk->prev;
-		old_index = class_index(temp->size);
+		old_size = temp->size;
 		merge_next(blk);
 		merge_next(blk->prev);
-		if (old_index != class_index(temp->size)) {
-			free_blk_remove(temp);
-			free_blk_add(temp);
-		}
+		free_blk_resize(temp, old_size);
 	}
 }
 
 // Inline to avoid unused warnings
 // First fit search for implicit free list, return pointer to payload section, NULL if no fit found
 static inline blk_elt * first_fit(size_t asize) {
-	blk_elt * cur_search = list_start->next;
+	blk_elt * cur_search = cur_heap->list_start->next;
 	// Repeat until epilogue block is reached
 	while (cur_search->size) {
 		if ((cur_search->alloc == 0) && (cur_search->size >= asize)) {
@@ -181,7 +227,7 @@ static inline blk_elt * first_fit(size_t asize) {
 
 // Best fit search for implicit free list, return pointer to payload, NULL if not found
 static inline blk_elt * best_fit(size_t asize) {
-	blk_elt * cur_search = list_start->next;
+	blk_elt * cur_search = cur_heap->list_start->next;
 	size_t cur_size = 0;
 	blk_elt * best_result = NULL;
 	size_t best_size = (size_t)-1; // Default to max size
@@ -206,7 +252,7 @@ static inline blk_elt * seg_fit(size_t asize) {
 	blk_elt * cur_search;	
 	// Loop through class sizes starting at index
 	while (index < SIZE_CLASSES) {
-		cur_search = class_table[index].next_free;
+		cur_search = cur_heap->class_table[index].next_free;
 		// Look through all free blocks in current class
 		while (cur_search->size) {
 			if (cur_search->size >= asize) {
@@ -219,9 +265,16 @@ static inline blk_elt * seg_fit(size_t asize) {
 	return 0;
 }
 
+// Coalesce and record the time taken
+static void coalesce(blk_elt * blk) {
+	uint64_t start = lat_start();
+	coalesce_blks(blk);
+	lat_record(LAT_COALESCE, start);
+}
+
 // Place fit algorithm here
-static blk_elt * find_fit(size_t asize) {
-	switch (SEARCH_OPT) {
+static blk_elt * search_fit(size_t asize) {
+	switch (cur_heap->search_opt) {
 		case FIRST_FIT:
 			return first_fit(asize);
 		case BEST_FIT:
@@ -234,6 +287,14 @@ static blk_elt * find_fit(size_t asize) {
 	}
 }
 
+// Search for a free block and record the time taken
+static blk_elt * find_fit(size_t asize) {
+	uint64_t start = lat_start();
+	blk_elt * blk = search_fit(asize);
+	lat_record(LAT_FIND_FIT, start);
+	return blk;
+}
+
 // Put an asize allocated block at free block blk
 static void place(blk_elt * blk, size_t asize) {
 	size_t original_size = blk->size;
@@ -244,9 +305,9 @@ static void place(blk_elt * blk, size_t asize) {
 		// Split block into allocated and free blocks
 		free_size = original_size-asize;
 		// Allocate original block
+		free_blk_remove(blk);
 		blk->alloc = 1;
 		blk->size = asize;
-		free_blk_remove(blk);
 		// Make new free block
 		new_blk = malloc(sizeof(blk_elt));
 		new_blk->next = blk->next;
@@ -265,6 +326,8 @@ static void place(blk_elt * blk, size_t asize) {
 		blk->alloc = 1;
 		free_blk_remove(blk);
 	}
+	cur_heap->live_bytes += blk->size;
+	cur_heap->live_blocks++;
 }
 
 // Shrink current block
@@ -293,6 +356,7 @@ static void shrink_blk(blk_elt * blk, size_t asize) {
 		blk->next = new_blk;
 		// Update original block
 		blk->size = asize;
+		cur_heap->live_bytes -= free_size;
 
 		coalesce(new_blk);
 	}
@@ -301,13 +365,14 @@ static void shrink_blk(blk_elt * blk, size_t asize) {
 
 // Extend current block
 static void extend_blk(blk_elt * blk, size_t asize) {
+	size_t original_size = blk->size;
 	size_t combined_size = blk->size + blk->next->size;
 	size_t free_size;
 	uint32_t free_p;
-	size_t old_index;
+	size_t old_size;
 	// Check if there is free block leftover 
 	if (combined_size > asize) {
-		old_index = class_index(blk->next->size);
+		old_size = blk->next->size;
 		free_size = combined_size-asize;
 		free_p = blk->ptr + asize;
 		// Shrink next free block
@@ -318,25 +383,23 @@ static void extend_blk(blk_elt * blk, size_t asize) {
 		// Update current block size
 		blk->size = asize;
 		// Update block in class table if needed
-		if (class_index(blk->next->size) != old_index) {
-			free_blk_remove(blk->next);
-			free_blk_add(blk->next);
-		}
+		free_blk_resize(blk->next, old_size);
 	} else {
 		merge_next(blk);
 	}
+	cur_heap->live_bytes += blk->size - original_size;
 }
 
 // Clear heap info list
 void mm_heap_reset(void) {
-	blk_elt * cur_blk = list_start->next;
+	blk_elt * cur_blk = cur_heap->list_start->next;
 	blk_elt * temp_blk;
 	while (cur_blk->size) {
 		temp_blk = cur_blk;
 		cur_blk = cur_blk->next;
 		free(temp_blk);
 	}
-	list_start->next = list_start->prev = list_start;
+	cur_heap->list_start->next = cur_heap->list_start->prev = cur_heap->list_start;
 }
 
 // Insert free block to linked list
@@ -344,9 +407,9 @@ void mm_sbrk(int incr) {
 	blk_elt * new_blk;
 	// Make new block
 	new_blk = malloc(sizeof(blk_elt));
-	new_blk->next = list_start;
-	new_blk->prev = list_start->prev;
-	new_blk->ptr = list_start->prev->ptr + list_start->prev->size;
+	new_blk->next = cur_heap->list_start;
+	new_blk->prev = cur_heap->list_start->prev;
+	new_blk->ptr = cur_heap->list_start->prev->ptr + cur_heap->list_start->prev->size;
 	new_blk->size = incr;
 	new_blk->alloc = 0;
 	// Add to free list and dict
@@ -354,8 +417,8 @@ void mm_sbrk(int incr) {
 	dict_insert(new_blk->ptr, new_blk);
 
 	// Insert it before starting block
-	list_start->prev->next = new_blk;
-	list_start->prev = new_blk;
+	cur_heap->list_start->prev->next = new_blk;
+	cur_heap->list_start->prev = new_blk;
 
 	// Coalesce it
 	coalesce(new_blk);
@@ -368,34 +431,44 @@ int mm_init(uint32_t ptr)
 
 	// Initialze class table
 	for (int i=0; i<SIZE_CLASSES; i++) {
-		class_table[i].prev = NULL;
-		class_table[i].next = NULL;
-		class_table[i].next_free = &(class_table[i]);
-		class_table[i].prev_free = &(class_table[i]);
-		class_table[i].ptr = 0;
-		class_table[i].size = 0;
-		class_table[i].alloc = 1;
+		cur_heap->class_table[i].prev = NULL;
+		cur_heap->class_table[i].next = NULL;
+		cur_heap->class_table[i].next_free = &(cur_heap->class_table[i]);
+		cur_heap->class_table[i].prev_free = &(cur_heap->class_table[i]);
+		cur_heap->class_table[i].ptr = 0;
+		cur_heap->class_table[i].size = 0;
+		cur_heap->class_table[i].alloc = 1;
 	}
 
 	// Allocate starter block
-	if (list_start) {
+	if (cur_heap->list_start) {
 		mm_heap_reset();
 	} else {
-		list_start = malloc(sizeof(blk_elt));
-		list_start->next = list_start->prev = list_start;
-		list_start->ptr = ptr;
-		list_start->size = 0;
-		list_start->alloc = 1;
+		cur_heap->list_start = malloc(sizeof(blk_elt));
+		cur_heap->list_start->next = cur_heap->list_start->prev = cur_heap->list_start;
+		cur_heap->list_start->ptr = ptr;
+		cur_heap->list_start->size = 0;
+		cur_heap->list_start->alloc = 1;
 	}
+	cur_heap->live_bytes = 0;
+	cur_heap->live_blocks = 0;
+	cur_heap->size_queue_count = 0;
 
     return 0;
 }
 
+// Block size of a size byte region with overhead and alignment
+static size_t malloc_asize(size_t size) {
+	if (size <= DSIZE) {
+		return DSIZE;
+	}
+	return DSIZE * ((size + (DSIZE) + (DSIZE-1))/DSIZE); // Add overhead and make rounding floor
+}
+
 // Allocate region of size bytes and return pointer, return NULL if sbrk needed
 uint32_t mm_malloc(size_t size)
 {
 	size_t asize; // Adjusted block size
-	size_t extendsize; // Amount to extend heap by
 	blk_elt * blk;
 
 	// Ignore 0 size
@@ -404,11 +477,7 @@ uint32_t mm_malloc(size_t size)
 	}
 
 	// Add overhead and alignment to block size
-	if (size <= DSIZE) {
-		asize = DSIZE;
-	} else {
-		asize = DSIZE * ((size + (DSIZE) + (DSIZE-1))/DSIZE); // Add overhead and make rounding floor
-	}
+	asize = malloc_asize(size);
 
 	// Search free block for fit
 	if ((blk = find_fit(asize)) != NULL) {
@@ -421,18 +490,171 @@ uint32_t mm_malloc(size_t size)
 	return 0;
 }
 
+// Allocate size byte region at a multiple of alignment (a power of 2), the space in front stays a free block
+uint32_t mm_memalign(size_t alignment, size_t size)
+{
+	size_t asize = malloc_asize(size);
+	size_t lead; // Free space left in front of the aligned block
+	blk_elt * blk;
+	blk_elt * new_blk;
+
+	if (size == 0 || (alignment & (alignment-1))) {
+		return 0;
+	}
+	if (alignment <= DSIZE) {
+		// Every block is aligned this far
+		return mm_malloc(size);
+	}
+
+	// Room for the block wherever the fit starts
+	if ((blk = find_fit(asize + alignment)) == NULL) {
+		return 0;
+	}
+	lead = ((blk->ptr + alignment-1) & ~(uint32_t)(alignment-1)) - blk->ptr;
+	if (lead && lead < DSIZE) {
+		// Too small for a free block of its own
+		lead += alignment;
+	}
+	if (lead + asize > blk->size) {
+		return 0;
+	}
+	if (lead) {
+		// Split the leading fragment off as a free block
+		new_blk = malloc(sizeof(blk_elt));
+		new_blk->next = blk->next;
+		new_blk->prev = blk;
+		new_blk->ptr = blk->ptr + lead;
+		new_blk->size = blk->size - lead;
+		new_blk->alloc = 0;
+		blk->next->prev = new_blk;
+		blk->next = new_blk;
+		free_blk_remove(blk);
+		blk->size = lead;
+		free_blk_add(blk);
+		free_blk_add(new_blk);
+		dict_insert(new_blk->ptr, new_blk);
+		blk = new_blk;
+	}
+	place(blk, asize);
+	return blk->ptr;
+}
+
+// Usable bytes of the allocated block at ptr, the whole block since its metadata lives here
+size_t mm_usable_size(uint32_t ptr)
+{
+	blk_elt * blk = ptr ? blk_search(ptr) : NULL;
+	return (blk && blk->alloc) ? blk->size : 0;
+}
+
+// Check a realloc the MCU answered itself, returns 1 when size fits the block at ptr
+int mm_resize(uint32_t ptr, size_t size)
+{
+	return size && size <= mm_usable_size(ptr);
+}
+
+// Allocate count regions of sizes into ptrs, back to back from one free block when one fits them all
+void mm_malloc_bulk(uint32_t * sizes, size_t count, uint32_t * ptrs)
+{
+	size_t total = 0;
+	blk_elt * blk;
+
+	for (size_t i=0; i<count; i++) {
+		total += sizes[i] ? malloc_asize(sizes[i]) : 0;
+	}
+	if (total == 0 || (blk = find_fit(total)) == NULL) {
+		// No single fit, place them one by one
+		for (size_t i=0; i<count; i++) {
+			ptrs[i] = mm_malloc(sizes[i]);
+		}
+		return;
+	}
+	// Each placement leaves the rest of the free block right after the new one
+	for (size_t i=0; i<count; i++) {
+		if (sizes[i] == 0) {
+			ptrs[i] = 0;
+			continue;
+		}
+		place(blk, malloc_asize(sizes[i]));
+		ptrs[i] = blk->ptr;
+		blk = blk->next;
+	}
+}
+
+// Returns 1 when blk is an allocated block that holds the size bytes of a sized free (0 when not sized)
+static int free_check(blk_elt * blk, uint32_t ptr, size_t size)
+{
+	if (!blk || !blk->alloc) {
+		puts("Pointer for free not found");
+		return 0;
+	}
+	if (size > blk->size) {
+		// MCU freed more than it was given: a bug on one side, keep the block rather than free a wrong one
+		printf("Sized free of %08x with size %zu, block holds %zu\n", ptr, size, blk->size);
+		return 0;
+	}
+	return 1;
+}
+
 // Free region at ptr
 void mm_free(uint32_t ptr)
+{
+	mm_free_sized(ptr, 0);
+}
+
+// Free region at ptr that the MCU allocated size bytes of, 0 when not known
+void mm_free_sized(uint32_t ptr, size_t size)
 {
 	blk_elt * freed_blk = blk_search(ptr);
 
 	// Free block and coalesce it
-	if (freed_blk) {
+	if (free_check(freed_blk, ptr, size)) {
 		freed_blk->alloc = 0;
+		cur_heap->live_bytes -= freed_blk->size;
+		cur_heap->live_blocks--;
+		free_blk_add(freed_blk);
+		coalesce(freed_blk);
+	}
+}
+
+// Order frees by address
+static int free_compare(const void * a, const void * b) {
+	uint32_t x = ((const free_elt *)a)->ptr;
+	uint32_t y = ((const free_elt *)b)->ptr;
+	return (x > y) - (x < y);
+}
+
+// Free the count regions in frees (sorted in place), adjacent regions are joined before one coalesce
+void mm_free_batch(free_elt * frees, size_t count)
+{
+	blk_elt * freed_blk;
+	blk_elt * temp;
+	qsort(frees, count, sizeof(free_elt), free_compare);
+	for (size_t i=0; i<count; i++) {
+		freed_blk = blk_search(frees[i].ptr);
+		if (!free_check(freed_blk, frees[i].ptr, frees[i].size)) {
+			continue;
+		}
+		freed_blk->alloc = 0;
+		cur_heap->live_bytes -= freed_blk->size;
+		cur_heap->live_blocks--;
+		// Absorb the following blocks of the batch while they are neighbors, they are not on a free list yet
+		while (i+1 < count && freed_blk->next->ptr == frees[i+1].ptr && freed_blk->next->alloc && freed_blk->next->size) {
+			if (frees[i+1].size > freed_blk->next->size) {
+				// Leave it to the next round to report
+				break;
+			}
+			temp = freed_blk->next;
+			cur_heap->live_bytes -= temp->size;
+			cur_heap->live_blocks--;
+			freed_blk->size += temp->size;
+			temp->next->prev = freed_blk;
+			freed_blk->next = temp->next;
+			dict_delete(temp->ptr);
+			free(temp);
+			i++;
+		}
 		free_blk_add(freed_blk);
 		coalesce(freed_blk);
-	} else {
-		puts("Pointer for free not found");
 	}
 }
 
@@ -440,7 +662,6 @@ void mm_free(uint32_t ptr)
 uint32_t mm_realloc(uint32_t ptr, size_t size)
 {
     uint32_t oldptr = ptr;
-    uint32_t newptr;
 	size_t blk_size;
 	size_t asize;
 	size_t next_size;
@@ -485,18 +706,35 @@ uint32_t mm_realloc(uint32_t ptr, size_t size)
 	}
 }
 
+// Size of the largest free block, the first in the size queue
+static size_t largest_free(void) {
+	return cur_heap->size_queue_count ? cur_heap->size_queue[0]->size : 0;
+}
+
+// Fill stats from the counters kept as blocks are placed, resized and freed
+void mm_stats(heap_stats * stats)
+{
+	stats->live_bytes = cur_heap->live_bytes;
+	stats->free_bytes = mem_heapsize() - cur_heap->live_bytes;
+	stats->largest_free = largest_free();
+	stats->fragmentation = stats->free_bytes ? 1000 - (1000*stats->largest_free)/stats->free_bytes : 0;
+	stats->live_blocks = cur_heap->live_blocks;
+	// Every block is in the dict
+	stats->free_blocks = cur_heap->pointer_dict.count - cur_heap->live_blocks;
+}
+
 // Print all block list elements
 void list_print(void) {
-	if (!list_start) {
+	if (!cur_heap->list_start) {
 		puts("list not initialized");
 		return;
 	}
 
 	// Start block information
-	blk_elt * cur_blk = list_start;
-	blk_elt * prev = list_start;
+	blk_elt * cur_blk = cur_heap->list_start;
+	blk_elt * prev = cur_heap->list_start;
 	printf("The start block: %u alloc, %zu size, %08x ptr\n", cur_blk->alloc, cur_blk->size, cur_blk->ptr); 
-	cur_blk = list_start->next;
+	cur_blk = cur_heap->list_start->next;
 
 	// Loop through block list
 	for (size_t i=1; cur_blk->size; i++) {
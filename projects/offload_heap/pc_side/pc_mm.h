@@ -1,11 +1,34 @@
 #include "memlib.h"
 
+// Free waiting to be applied, size is the size the MCU freed or 0 when it was not sent
+typedef struct {
+	uint32_t ptr;
+	uint32_t size;
+} free_elt;
+
+// Heap statistics reported to the MCU
+typedef struct {
+	size_t live_bytes; // Bytes in allocated blocks
+	size_t free_bytes; // Bytes in free blocks
+	size_t largest_free; // Largest free block
+	size_t fragmentation; // Free bytes outside the largest free block, in 1/1000 of the free bytes
+	size_t live_blocks;
+	size_t free_blocks;
+} heap_stats;
+
 extern int mm_init (uint32_t); // Initialize data structures and peripherals
 extern uint32_t mm_malloc (size_t size); // Allocate size byte region and return pointer, return NULL if sbrk needed
+extern uint32_t mm_memalign(size_t alignment, size_t size); // Allocate size byte region at a multiple of alignment, return NULL if sbrk needed
+extern size_t mm_usable_size(uint32_t ptr); // Usable bytes of the allocated block at ptr, 0 if there is none
+extern int mm_resize(uint32_t ptr, size_t size); // Check that size fits the allocated block at ptr, returns 1 when it does
+extern void mm_malloc_bulk(uint32_t * sizes, size_t count, uint32_t * ptrs); // Allocate count regions in one pass, NULL entries need sbrk
 extern void mm_free (uint32_t ptr); // Free memory at ptr
+extern void mm_free_sized(uint32_t ptr, size_t size); // Free memory at ptr, checking that the block holds size bytes (0 skips the check)
+extern void mm_free_batch(free_elt * frees, size_t count); // Free count regions, sorting frees by address
 extern uint32_t mm_realloc(uint32_t ptr, size_t size); // Allocate size byte region with data at ptr, returns NULL if malloc needed
 extern void mm_sbrk(int incr); // Increment brk by incr and update relavent structures
 extern void mm_heap_reset(); // Reset brk to heap start
+extern void mm_stats(heap_stats * stats); // Fill stats from the counters kept as blocks change
 extern void list_print(void); // Print memory block list and check for consistency
 
 // Memory block information struct
@@ -16,6 +39,7 @@ struct blk_struct {
 	struct blk_struct * prev_free;
 	uint32_t ptr;
 	size_t size;
+	size_t size_pos; // Index in the size queue while free
 	char alloc;
 };
 
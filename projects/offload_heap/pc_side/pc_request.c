@@ -1,92 +1,469 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <termios.h>
-#include <fcntl.h>
-#include <unistd.h>
 #include <string.h>
 #include <assert.h>
+#include <sched.h>
+#include <pthread.h>
 #include <unistd.h>
-#include <assert.h>
+#include <sys/eventfd.h>
 
 #include "pc_request.h"
+#include "pc_transport.h"
+#include "pc_event.h"
+#include "pc_ring.h"
+#include "../shared_side/link_frame.h"
 
-static int fd; // Serial device file descriptor
-static char receive_buffer[BUFFERSIZE*2] = {0};
-static char chunk_buffer[BUFFERSIZE*2] = {0};
-
-// Concatenate size bytes of data from src to dest starting at start'th index
-static void data_cat(char * dest, char * src, size_t start, size_t size) {
-	for (size_t i=0; i<size; i++) {
-		dest[start+i] = src[i];
-	}
-}
+// Request queue size (power of 2), the mcu waits for a response after a few requests so it never fills up
+#define PIPELINE_QUEUE 256
+// Queue polls before the allocator thread sleeps, when it has a core of its own
+#define PIPELINE_SPIN 2000
 
-// Set up serial device
-static void serial_setup(int fd) {
-	struct termios serial_settings;
-	tcgetattr(fd, &serial_settings);
+static char receive_buffer[BUFFERSIZE*2] = {0};
+static size_t rx_start = 0; // First unprocessed byte in receive_buffer
+static size_t rx_end = 0; // End of received data in receive_buffer
 
-	// Set buad rate
-	cfsetispeed(&serial_settings, BAUDRATE);
-	cfsetospeed(&serial_settings, BAUDRATE);
+// Link layer state
+static uint8_t frame_buffer[FRAME_MAX*2]; // Raw bytes not yet parsed into frames
+static size_t frame_end = 0; // End of received data in frame_buffer
+static uint8_t tx_seq = 0; // Sequence number of next data frame sent
+static uint8_t rx_seq = 0; // Sequence number of next data frame expected
+static uint8_t tx_history[LINK_WINDOW][FRAME_MAX_PAYLOAD]; // Payloads of the last sent frames
+static size_t tx_history_len[LINK_WINDOW];
+static int nack_sent = 0; // NACK for rx_seq already sent
 
-	// Set raw mode (no special processing)
-	cfmakeraw(&serial_settings);
-	
-	serial_settings.c_cflag &= ~CRTSCTS; // Hardware based flow control off
-	serial_settings.c_cflag |= CREAD | CLOCAL; // Turn on receiver
+// Pipeline state: the I/O thread reads, parses and decodes, the allocator thread sends its responses itself
+static ring rx_queue; // Decoded requests, I/O thread to allocator thread
+static int rx_wake = -1; // eventfd the allocator thread sleeps on
+static atomic_int worker_waiting = 0; // Allocator thread is, or is about to be, asleep on rx_wake
+static pthread_mutex_t tx_lock = PTHREAD_MUTEX_INITIALIZER; // Held while writing, the link layer's acks and resends come from the I/O thread
+static size_t spin = 0; // Queue polls before sleeping, 0 on a single core where polling only delays the I/O thread
+static int io_running = 1; // Cleared by the I/O thread once it read the end signal
+static pthread_t io_thread;
 
-	// Read for 0.5 seconds at max
-	// serial_settings.c_cc[VTIME] = 5;
-	tcflush(fd, TCIOFLUSH); // Clear IO buffer
-	tcsetattr(fd, TCSANOW, &serial_settings); // Apply settings
-}
+// Work run when no request is waiting
+static void (*idle_work)(void) = NULL;
 
-// Setup UART file descriptor
-void uart_setup(void) {
-	fd = open(SERIALDEV, O_RDWR | O_NOCTTY);
-	assert(fd >= 0); // Error when not ran with sudo
-	serial_setup(fd);
-	assert(fd>=0);
-}
+// Session options, the compiled ones until a HELLO negotiates others
+static codec_hello session = {
+	.version = 0,
+	.batch = FREE_QUEUE_SIZE,
+	.frame = FRAME_MAX_PAYLOAD,
+	.caps = (COMPACT_ENCODING ? CAP_COMPACT : 0) | (MAGAZINES ? CAP_MAGAZINES : 0),
+};
+static int first_request = 1; // Only the first request of a session may be a HELLO
+static uint32_t bulk_left = 0; // Sizes still to decode after a MALLOC_BULK
 
-// Wait for size bytes of data to be read into buffer from UART
-static void uart_read(size_t size, void * buffer) {
-	size_t bytes_read = 0;
-	size_t chunk_read = 0;
+// Read up to size bytes of available data into buffer from the transport, returns bytes read
+static size_t uart_read(size_t size, void * buffer) {
+	size_t chunk_read;
 	if (VERBOSE) {
 		puts("pc receive start");
 	}
-	// Loop until expected bytes of data is received
-	while (bytes_read < size) {
-		// Read data by chunks and concat them together
-		chunk_read = read(fd, chunk_buffer, size-bytes_read);
-		data_cat(buffer, chunk_buffer, bytes_read, chunk_read);
-		bytes_read += chunk_read;
-		memset(chunk_buffer, 0, BUFFERSIZE*2);
-	}
+	chunk_read = transport_read(size, buffer);
 	if (VERBOSE) {
 		puts("pc receive end");
 	}
+	return chunk_read;
 }
 
-// Send size bytes of data from buffer through UART
+// Send size bytes of data from buffer through the transport
 static void uart_send(size_t size, void * buffer) {
 	if (VERBOSE) {
 		puts("pc send start");
 	}
-	assert(write(fd, buffer, size));
+	transport_write(size, buffer);
 	if (VERBOSE) {
 		puts("pc send end");
 	}
 }
 
+// Send a single frame
+static void link_frame_send(uint8_t type, uint8_t seq, const void * payload, size_t len) {
+	uint8_t frame[FRAME_MAX];
+	uart_send(frame_build(frame, type, seq, payload, len), frame);
+}
+
+// Ask the mcu to resend from rx_seq, once until the next frame is accepted
+static void link_nack(void) {
+	if (!nack_sent) {
+		link_frame_send(FRAME_NACK, rx_seq, NULL, 0);
+		nack_sent = 1;
+	}
+}
+
+// Resend data frames from seq onwards if they are still in the history
+static void link_resend(uint8_t seq) {
+	if (SEQ_DIFF(tx_seq, seq) > LINK_WINDOW) {
+		return;
+	}
+	for (; seq != tx_seq; seq = (seq+1) & FRAME_SEQ_MASK) {
+		link_frame_send(FRAME_DATA, seq, tx_history[seq%LINK_WINDOW], tx_history_len[seq%LINK_WINDOW]);
+	}
+}
+
+// Send payload as the next data frames, each no larger than the agreed frame payload
+static void link_send(size_t len, void * payload) {
+	size_t chunk;
+	do {
+		chunk = (len < session.frame) ? len : session.frame;
+		memcpy(tx_history[tx_seq%LINK_WINDOW], payload, chunk);
+		tx_history_len[tx_seq%LINK_WINDOW] = chunk;
+		link_frame_send(FRAME_DATA, tx_seq, payload, chunk);
+		tx_seq = (tx_seq+1) & FRAME_SEQ_MASK;
+		payload = (uint8_t *)payload + chunk;
+		len -= chunk;
+	} while (len);
+}
+
+// Handle a valid frame, copies in sequence payload to buffer and returns its length
+static size_t link_handle(uint8_t * frame, void * buffer) {
+	uint8_t type = FRAME_TYPE(frame);
+	uint8_t seq = FRAME_SEQ(frame);
+	size_t len = 0;
+	switch (type) {
+		case FRAME_NACK:
+			link_resend(seq);
+			return 0;
+		case FRAME_ACK:
+			return 0;
+	}
+	if (seq == rx_seq) {
+		// In sequence, accept
+		len = FRAME_LEN(frame);
+		memcpy(buffer, frame+FRAME_HEADER, len);
+		rx_seq = (rx_seq+1) & FRAME_SEQ_MASK;
+		nack_sent = 0;
+	} else if (!SEQ_OLD(seq, rx_seq) && type != FRAME_DATA_ACKREQ) {
+		// Gap, a frame was lost
+		link_nack();
+	}
+	// Duplicates are dropped, the ACK tells the mcu where we are
+	if (type == FRAME_DATA_ACKREQ) {
+		link_frame_send(FRAME_ACK, rx_seq, NULL, 0);
+	}
+	return len;
+}
+
+// Parse complete frames in frame_buffer, appending in sequence payload to receive_buffer
+static void link_parse(void) {
+	size_t skip, len;
+	while (1) {
+		// Drop bytes before the next sync byte
+		for (skip = 0; skip < frame_end && frame_buffer[skip] != FRAME_SYNC; skip++);
+		memmove(frame_buffer, frame_buffer+skip, frame_end-skip);
+		frame_end -= skip;
+		if (frame_end < FRAME_HEADER || frame_end < (size_t)FRAME_LEN(frame_buffer)+FRAME_OVERHEAD) {
+			return;
+		}
+		if (!frame_check(frame_buffer)) {
+			// Resync from the byte after this false sync
+			memmove(frame_buffer, frame_buffer+1, frame_end-1);
+			frame_end--;
+			link_nack();
+			continue;
+		}
+		assert(sizeof(receive_buffer)-rx_end >= FRAME_MAX_PAYLOAD);
+		rx_end += link_handle(frame_buffer, receive_buffer+rx_end);
+		len = FRAME_LEN(frame_buffer)+FRAME_OVERHEAD;
+		memmove(frame_buffer, frame_buffer+len, frame_end-len);
+		frame_end -= len;
+	}
+}
+
+// Transport readable: move the available bytes into receive_buffer, through the link layer if enabled
+static void req_readable(int fd) {
+	// Reads go through the transport, which owns fd
+	(void)fd;
+	// Move partial request to buffer start to make room
+	memmove(receive_buffer, receive_buffer+rx_start, rx_end-rx_start);
+	rx_end -= rx_start;
+	rx_start = 0;
+	if (LINK_FRAMING) {
+		frame_end += uart_read(sizeof(frame_buffer)-frame_end, frame_buffer+frame_end);
+		pthread_mutex_lock(&tx_lock);
+		link_parse();
+		pthread_mutex_unlock(&tx_lock);
+	} else {
+		rx_end += uart_read(sizeof(receive_buffer)-rx_end, receive_buffer+rx_end);
+	}
+}
+
+// Agree on the options both the mcu's offer and the server support, and switch the codec to them
+static void hello_negotiate(const codec_hello * offer) {
+	session.version = offer->version < PROTOCOL_VERSION ? offer->version : PROTOCOL_VERSION;
+	// Request ids and the requests added with them need a HELLO to switch them on, the server always handles them
+	session.caps = (session.caps | CAP_REQ_ID | CAP_BULK | CAP_MEMALIGN | CAP_USABLE | CAP_SIZED_FREE | CAP_STATS) & offer->caps;
+	if (offer->frame && offer->frame < session.frame) {
+		session.frame = offer->frame;
+	}
+	session.batch = offer->batch;
+	// A batch goes out in one frame
+	if (LINK_FRAMING && session.batch > session.frame/CODEC_MAX_REQ) {
+		session.batch = session.frame/CODEC_MAX_REQ;
+	}
+	// So does a malloc response with its id and a full grant
+	if (LINK_FRAMING && session.frame < (MAG_BLOCKS+3)*CODEC_MAX_WORD) {
+		session.caps &= ~CAP_MAGAZINES;
+	}
+	// The mcu sends nothing else before it reads the response, so later requests decode with the new encoding
+	codec_set_compact(session.caps & CAP_COMPACT ? 1 : 0);
+	codec_set_ids(session.caps & CAP_REQ_ID ? 1 : 0);
+}
+
+// Decode the next buffered request into buffer, returns 0 when no complete request is buffered
+static int req_decode(mem_request * buffer) {
+	uint32_t request, size, ptr, id;
+	size_t used;
+	codec_hello offer;
+	if (first_request && rx_end > rx_start && codec_is_hello((uint8_t *)receive_buffer+rx_start)) {
+		if (rx_end-rx_start < CODEC_HELLO_SIZE) {
+			return 0;
+		}
+		codec_hello_decode((uint8_t *)receive_buffer+rx_start, &offer);
+		rx_start += CODEC_HELLO_SIZE;
+		hello_negotiate(&offer);
+		first_request = 0;
+		*buffer = (mem_request){.request = HELLO, .size = 0, .ptr = 0, .id = 0};
+		return 1;
+	}
+	if (bulk_left) {
+		// Sizes of a bulk malloc arrive as malloc requests
+		used = codec_size_decode((uint8_t *)receive_buffer+rx_start, rx_end-rx_start, &size);
+		if (!used) {
+			return 0;
+		}
+		rx_start += used;
+		bulk_left--;
+		*buffer = (mem_request){.request = MALLOC, .size = size, .ptr = 0, .id = 0};
+		return 1;
+	}
+	used = codec_req_decode((uint8_t *)receive_buffer+rx_start, rx_end-rx_start, &request, &size, &ptr, &id);
+	if (!used) {
+		return 0;
+	}
+	if (request == MALLOC_BULK) {
+		bulk_left = size;
+	}
+	first_request = 0;
+	rx_start += used;
+	buffer->request = request;
+	buffer->size = size;
+	buffer->ptr = ptr;
+	buffer->id = id;
+	// Later pointers in both directions are relative to the new heap start
+	if (request == SBRK && size == 0 && ptr) {
+		codec_set_base(ptr);
+	}
+	return 1;
+}
+
+// Transport readable on the I/O thread: queue every complete request for the allocator thread
+static void io_readable(int fd) {
+	mem_request request;
+	size_t queued = 0;
+	req_readable(fd);
+	while (io_running && req_decode(&request)) {
+		while (!ring_push(&rx_queue, &request)) {
+			sched_yield();
+		}
+		queued++;
+		if (request.request == SBRK && request.size == 0 && request.ptr == 0) {
+			// End signal, nothing follows
+			io_running = 0;
+		}
+	}
+	// Pairs with the fence in req_receive so a sleeping allocator thread always sees the wakeup
+	atomic_thread_fence(memory_order_seq_cst);
+	if (queued && atomic_load(&worker_waiting)) {
+		eventfd_write(rx_wake, 1);
+	}
+}
+
+// I/O thread: serve the transport until the end signal is read
+static void * io_main(void * arg) {
+	while (io_running) {
+		event_dispatch(-1);
+	}
+	return arg;
+}
+
+// Open the transport to the mcu and serve it from the event loop, NULL name or arg for defaults
+void req_setup(const char * name, const char * arg) {
+	event_init();
+	if (!PIPELINE) {
+		event_add(transport_setup(name, arg), req_readable);
+		return;
+	}
+	ring_init(&rx_queue, PIPELINE_QUEUE, sizeof(mem_request));
+	rx_wake = eventfd(0, EFD_CLOEXEC);
+	if (rx_wake < 0) {
+		perror("eventfd");
+		exit(1);
+	}
+	if (sysconf(_SC_NPROCESSORS_ONLN) > 1) {
+		spin = PIPELINE_SPIN;
+	}
+	event_add(transport_setup(name, arg), io_readable);
+	int err = pthread_create(&io_thread, NULL, io_main, NULL);
+	if (err) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(err));
+		exit(1);
+	}
+}
+
+// Run idle before waiting for a request, for work that should not delay responses
+void req_set_idle(void (*idle)(void)) {
+	idle_work = idle;
+}
+
+// Close the transport once the mcu has read the last response
+void req_close(void) {
+	if (PIPELINE) {
+		pthread_join(io_thread, NULL);
+		ring_destroy(&rx_queue);
+	}
+	transport_close();
+}
+
+// Apply the codec changes of a request on the allocator thread, the I/O thread only changes its own codec state
+static void codec_follow(const mem_request * request) {
+	if (request->request == HELLO) {
+		codec_set_compact(session.caps & CAP_COMPACT ? 1 : 0);
+		codec_set_ids(session.caps & CAP_REQ_ID ? 1 : 0);
+	} else if (request->request == SBRK && request->size == 0 && request->ptr) {
+		codec_set_base(request->ptr);
+	}
+}
+
+// Wait to receive a request from the I/O thread and write struct to buffer
+static void queue_receive(mem_request * buffer) {
+	eventfd_t count;
+	if (ring_pop(&rx_queue, buffer)) {
+		return;
+	}
+	if (idle_work) {
+		idle_work();
+	}
+	// Requests usually follow closely, poll before paying for a sleep and wakeup
+	for (size_t i=0; i<spin; i++) {
+		if (ring_pop(&rx_queue, buffer)) {
+			return;
+		}
+	}
+	while (1) {
+		atomic_store(&worker_waiting, 1);
+		atomic_thread_fence(memory_order_seq_cst);
+		if (ring_pop(&rx_queue, buffer)) {
+			break;
+		}
+		eventfd_read(rx_wake, &count);
+	}
+	atomic_store(&worker_waiting, 0);
+}
+
 // Wait to receive a request and write struct to buffer
 void req_receive(mem_request * buffer) {
-	uart_read(sizeof(mem_request), buffer);
+	if (!PIPELINE) {
+		// Serve events until a full request is buffered, buffered requests need no wakeup
+		if (!req_decode(buffer)) {
+			if (idle_work) {
+				idle_work();
+			}
+			while (!req_decode(buffer)) {
+				event_dispatch(-1);
+			}
+		}
+		return;
+	}
+	queue_receive(buffer);
+	codec_follow(buffer);
 }
 
-// Send a response stored in buffer back to mcu
+// Write response bytes as one frame or straight to UART
+static void stream_send(size_t size, void * buffer) {
+	pthread_mutex_lock(&tx_lock);
+	if (LINK_FRAMING) {
+		link_send(size, buffer);
+	} else {
+		uart_send(size, buffer);
+	}
+	pthread_mutex_unlock(&tx_lock);
+}
+
+// Send the start signal word stored in buffer to mcu
 void req_send(uint32_t * buffer) {
-	uart_send(sizeof(uint32_t), buffer);
+	uint8_t msg[CODEC_MAX_WORD];
+	stream_send(codec_ptr_encode(msg, *buffer), msg);
+}
+
+// Answer a HELLO with the negotiated session options
+void req_send_hello(void) {
+	uint8_t msg[CODEC_HELLO_SIZE];
+	stream_send(codec_hello_encode(msg, &session), msg);
+}
+
+// Session options in use, the compiled ones with version 0 when the mcu sent no HELLO
+const codec_hello * req_session(void) {
+	return &session;
+}
+
+// Encode the id of the request a response answers into buf when the session uses ids, returns length
+static size_t response_id(uint8_t * buf, uint32_t id) {
+	return codec_get_ids() ? codec_uint_encode(buf, id) : 0;
+}
+
+// Encode the usable size following response pointer ptr when the session has them, returns length
+static size_t response_usable(uint8_t * buf, uint32_t ptr, uint32_t usable) {
+	if (!ptr || !(session.caps & CAP_USABLE)) {
+		return 0;
+	}
+	// Round down so the compact encoding does not round it up past the block
+	return codec_size_encode(buf, usable - usable % WIRE_ALIGN);
+}
+
+// Send malloc or realloc response ptr with its usable size for request id
+void req_send_response(uint32_t id, uint32_t ptr, uint32_t usable) {
+	uint8_t msg[3*CODEC_MAX_WORD];
+	size_t len = response_id(msg, id);
+	len += codec_ptr_encode(msg+len, ptr);
+	len += response_usable(msg+len, ptr, usable);
+	stream_send(len, msg);
+}
+
+// Send the counts answering STATS request id
+void req_send_stats(uint32_t id, uint32_t * counts) {
+	uint8_t msg[(CODEC_STATS_WORDS+1)*CODEC_MAX_WORD];
+	size_t len = response_id(msg, id);
+	for (size_t i=0; i<CODEC_STATS_WORDS; i++) {
+		len += codec_uint_encode(msg+len, counts[i]);
+	}
+	stream_send(len, msg);
+}
+
+// Send the count pointers answering bulk malloc request id, NULL ptrs for count NULL pointers
+void req_send_bulk(uint32_t id, uint32_t * ptrs, size_t count) {
+	uint8_t msg[(BULK_MAX+1)*CODEC_MAX_WORD];
+	size_t len = response_id(msg, id);
+	for (size_t i=0; i<count; i++) {
+		if (len+CODEC_MAX_WORD > sizeof(msg)) {
+			// Only a refused bulk has more pointers than fit, the mcu reads them as one stream
+			stream_send(len, msg);
+			len = 0;
+		}
+		len += codec_ptr_encode(msg+len, ptrs ? ptrs[i] : 0);
+	}
+	stream_send(len, msg);
+}
+
+// Send malloc response ptr for request id followed by a grant of count blocks in one write
+void req_send_grant(uint32_t id, uint32_t ptr, uint32_t usable, uint32_t * blocks, size_t count) {
+	uint8_t msg[(MAG_BLOCKS+4)*CODEC_MAX_WORD];
+	size_t len = response_id(msg, id);
+	len += codec_ptr_encode(msg+len, ptr | GRANT_FLAG);
+	len += response_usable(msg+len, ptr, usable);
+	len += codec_uint_encode(msg+len, count);
+	for (size_t i=0; i<count; i++) {
+		len += codec_ptr_encode(msg+len, blocks[i]);
+	}
+	stream_send(len, msg);
 }
@@ -1,5 +1,13 @@
 #include "uart_comms.h"
 
-void uart_setup(void); // Setup uart device communications
+void req_setup(const char * name, const char * arg); // Open transport to the mcu, NULL for defaults
+void req_close(void); // Close transport once the mcu read the last response
 void req_receive(mem_request * buffer); // Wait and receive request from mcu
-void req_send(uint32_t * buffer); // Send request to mcu
+void req_set_idle(void (*idle)(void)); // Run idle before waiting for a request
+void req_send(uint32_t * buffer); // Send start signal word to mcu
+void req_send_response(uint32_t id, uint32_t ptr, uint32_t usable); // Send malloc or realloc response pointer and its usable size for request id
+void req_send_grant(uint32_t id, uint32_t ptr, uint32_t usable, uint32_t * blocks, size_t count); // Send malloc response followed by a magazine grant
+void req_send_stats(uint32_t id, uint32_t * counts); // Send the CODEC_STATS_WORDS counts answering a STATS request
+void req_send_bulk(uint32_t id, uint32_t * ptrs, size_t count); // Send the pointers answering a bulk malloc, NULL ptrs to refuse it
+void req_send_hello(void); // Answer a HELLO with the negotiated session options
+const codec_hello * req_session(void); // Session options in use
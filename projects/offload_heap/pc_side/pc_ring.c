@@ -0,0 +1,46 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "pc_ring.h"
+
+// Allocate capacity slots of elt_size bytes, capacity must be a power of two
+void ring_init(ring * r, size_t capacity, size_t elt_size) {
+	assert(capacity && !(capacity & (capacity-1)));
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+	r->capacity = capacity;
+	r->elt_size = elt_size;
+	r->slots = malloc(capacity * elt_size);
+	assert(r->slots);
+}
+
+// Copy elt into the queue, returns 0 when full, only called from the producer thread
+int ring_push(ring * r, const void * elt) {
+	size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	// Acquire pairs with the consumer's release so its read of the slot is done before it is overwritten
+	if (head - atomic_load_explicit(&r->tail, memory_order_acquire) == r->capacity) {
+		return 0;
+	}
+	memcpy(r->slots + (head & (r->capacity-1)) * r->elt_size, elt, r->elt_size);
+	// Publish the slot contents together with the new head
+	atomic_store_explicit(&r->head, head+1, memory_order_release);
+	return 1;
+}
+
+// Copy the oldest element into elt, returns 0 when empty, only called from the consumer thread
+int ring_pop(ring * r, void * elt) {
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	if (atomic_load_explicit(&r->head, memory_order_acquire) == tail) {
+		return 0;
+	}
+	memcpy(elt, r->slots + (tail & (r->capacity-1)) * r->elt_size, r->elt_size);
+	atomic_store_explicit(&r->tail, tail+1, memory_order_release);
+	return 1;
+}
+
+// Free the slots
+void ring_destroy(ring * r) {
+	free(r->slots);
+	r->slots = NULL;
+}
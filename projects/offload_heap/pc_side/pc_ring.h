@@ -0,0 +1,16 @@
+#include <stddef.h>
+#include <stdatomic.h>
+
+// Lock-free single producer single consumer queue of fixed size elements
+typedef struct {
+	_Alignas(64) atomic_size_t head; // Slots written, only advanced by the producer
+	_Alignas(64) atomic_size_t tail; // Slots read, only advanced by the consumer
+	_Alignas(64) size_t capacity; // Number of slots, a power of two
+	size_t elt_size; // Bytes per element
+	char * slots;
+} ring;
+
+void ring_init(ring * r, size_t capacity, size_t elt_size); // Allocate capacity (power of two) slots of elt_size bytes
+int ring_push(ring * r, const void * elt); // Producer: copy elt into the queue, returns 0 when full
+int ring_pop(ring * r, void * elt); // Consumer: copy the oldest element into elt, returns 0 when empty
+void ring_destroy(ring * r); // Free the slots
@@ -1,5 +1,9 @@
 #include "pc_request.h"
+#include "pc_magazine.h"
 #include "dict.h"
+#include "pc_latency.h"
+#include "pc_capture.h"
+#include "pc_shadow.h"
 #include <assert.h>
 
 // Send start signal of 1
@@ -8,21 +12,85 @@ static void start_signal(void) {
 	req_send(&req);
 }
 
+// Frees received but not yet applied to the heap
+static free_elt pending_frees[DEFER_FREES+1];
+static size_t pending_count = 0;
+
+// Apply the pending frees as one batch
+static void free_flush(void) {
+	if (pending_count) {
+		mm_free_batch(pending_frees, pending_count);
+		pending_count = 0;
+	}
+}
+
+// Hold back a free of size bytes (0 when not known) until the link is idle, a malloc needs the space or the queue is full
+static void free_defer(uint32_t ptr, uint32_t size) {
+	if (!DEFER_FREES) {
+		mm_free_sized(ptr, size);
+		return;
+	}
+	pending_frees[pending_count++] = (free_elt){.ptr = ptr, .size = size};
+	if (pending_count == DEFER_FREES) {
+		free_flush();
+	}
+}
+
+// Work that can wait until no request is pending
+static void idle(void) {
+	free_flush();
+	if (VERBOSE) {
+		// Print and check the block list
+		list_print();
+	}
+}
+
 int main(int argc, char ** argv) {
 	mem_request * req_in = malloc(sizeof(mem_request));
-	mem_request * req_out = malloc(sizeof(mem_request));
 	uint32_t ptr;
+	// Service start time of the current request
+	uint64_t start;
+	// Blocks of an optional magazine grant following a malloc response
+	uint32_t grant[MAG_BLOCKS];
+	size_t grant_count;
+	// Sizes and pointers of a bulk malloc
+	uint32_t bulk_sizes[BULK_MAX];
+	uint32_t bulk_ptrs[BULK_MAX];
+	mem_request bulk_item;
+	// Heap statistics answering a STATS request
+	heap_stats stats;
+	size_t bulk_count;
+	// Magazines are granted when both sides support them
+	int magazines;
+	const codec_hello * session;
 
-	uart_setup();
+	// Optional transport name and device, path or port
+	req_setup(argc > 1 ? argv[1] : NULL, argc > 2 ? argv[2] : NULL);
+	req_set_idle(idle);
 	start_signal();
+	capture_open();
+	shadow_start();
 
-	// Receive sbrk initialization request
+	// Firmware with HELLO negotiates options first, older firmware starts with the sbrk reset
 	req_receive(req_in);
+	if (req_in->request == HELLO) {
+		req_send_hello();
+		req_receive(req_in);
+	}
+	session = req_session();
+	magazines = MAGAZINES && (session->caps & CAP_MAGAZINES);
+	printf("Protocol version %u: %s encoding, batch %u, frame %u, magazines %s, request ids %s, bulk malloc %s, memalign %s, usable sizes %s, sized free %s, stats %s\n", session->version,
+			session->caps & CAP_COMPACT ? "compact" : "fixed", session->batch, session->frame, magazines ? "on" : "off",
+			session->caps & CAP_REQ_ID ? "on" : "off", session->caps & CAP_BULK ? "on" : "off",
+			session->caps & CAP_MEMALIGN ? "on" : "off", session->caps & CAP_USABLE ? "on" : "off",
+			session->caps & CAP_SIZED_FREE ? "on" : "off", session->caps & CAP_STATS ? "on" : "off");
+
+	// Receive sbrk initialization request
+	capture_request(req_in->request, req_in->size, req_in->ptr);
 	if (VERBOSE) {
 		printf("Request type: %u\n", req_in->request);
 		printf("Request size: %u\n", req_in->size);
 		printf("Request ptr: %08x\n", req_in->ptr);
-		list_print();
 	}
 	assert(req_in->request == SBRK && req_in->ptr);
 
@@ -32,15 +100,18 @@ int main(int argc, char ** argv) {
 	}
 	mem_reset_brk(req_in->ptr);
 	mm_init(req_in->ptr);
+	mag_init();
+	shadow_request(SBRK, 0, req_in->ptr, 0);
 
 	// Loop until end signal is received
 	while(1) {
 		req_receive(req_in);
+		start = lat_start();
+		capture_request(req_in->request, req_in->size, req_in->ptr);
 		if (VERBOSE) {
 			printf("Request type: %u\n", req_in->request);
 			printf("Request size: %u\n", req_in->size);
 			printf("Request ptr: %08x\n", req_in->ptr);
-			list_print();
 		}
 		switch (req_in -> request) {
 			case MALLOC:
@@ -48,29 +119,135 @@ int main(int argc, char ** argv) {
 					printf("Malloc request of size %u received.\n", req_in->size);
 				}
 				ptr = mm_malloc(req_in->size);
+				if (!ptr && pending_count) {
+					// Pending frees may make room without an sbrk
+					free_flush();
+					ptr = mm_malloc(req_in->size);
+				}
+				grant_count = 0;
+				if (magazines && ptr) {
+					mag_record(req_in->size);
+					grant_count = mag_grant(req_in->size, grant);
+				}
+				capture_response(ptr);
 				// Return request
-				req_send(&ptr);
+				if (grant_count) {
+					capture_grant(req_in->size, grant, grant_count);
+					req_send_grant(req_in->id, ptr, mm_usable_size(ptr), grant, grant_count);
+				} else {
+					req_send_response(req_in->id, ptr, mm_usable_size(ptr));
+				}
+				shadow_request(MALLOC, req_in->size, 0, ptr);
+				shadow_grant(req_in->size, grant, grant_count);
 				if (VERBOSE) {
-					printf("Malloc request finished: %08x\n", ptr);
+					printf("Malloc request finished: %08x, %zu blocks granted\n", ptr, grant_count);
+				}
+				break;
+			case MEMALIGN:
+				if (VERBOSE) {
+					printf("Memalign request of size %u and alignment %u received.\n", req_in->size, req_in->ptr);
+				}
+				ptr = mm_memalign(req_in->ptr, req_in->size);
+				if (!ptr && pending_count) {
+					// Pending frees may make room without an sbrk
+					free_flush();
+					ptr = mm_memalign(req_in->ptr, req_in->size);
+				}
+				capture_response(ptr);
+				req_send_response(req_in->id, ptr, mm_usable_size(ptr));
+				// Shadows place it as a plain malloc
+				shadow_request(MALLOC, req_in->size, 0, ptr);
+				if (VERBOSE) {
+					printf("Memalign request finished: %08x\n", ptr);
+				}
+				break;
+			case MALLOC_BULK:
+				if (VERBOSE) {
+					printf("Bulk malloc request of %u blocks received.\n", req_in->size);
+				}
+				bulk_count = req_in->size;
+				if (bulk_count > BULK_MAX) {
+					// The mcu never sends this many, skip the sizes and answer NULL so it mallocs them one by one
+					printf("Bulk malloc of %zu blocks is over BULK_MAX, refused\n", bulk_count);
+					for (size_t i=0; i<bulk_count; i++) {
+						req_receive(&bulk_item);
+					}
+					req_send_bulk(req_in->id, NULL, bulk_count);
+					break;
+				}
+				for (size_t i=0; i<bulk_count; i++) {
+					req_receive(&bulk_item);
+					bulk_sizes[i] = bulk_item.size;
+				}
+				// Coalesced free space gives the batch the best chance of one contiguous fit
+				free_flush();
+				mm_malloc_bulk(bulk_sizes, bulk_count, bulk_ptrs);
+				req_send_bulk(req_in->id, bulk_ptrs, bulk_count);
+				// Capture and shadows see the blocks as separate mallocs
+				for (size_t i=0; i<bulk_count; i++) {
+					capture_request(MALLOC, bulk_sizes[i], 0);
+					capture_response(bulk_ptrs[i]);
+					shadow_request(MALLOC, bulk_sizes[i], 0, bulk_ptrs[i]);
+				}
+				if (VERBOSE && bulk_count) {
+					printf("Bulk malloc request finished: %zu blocks from %08x\n", bulk_count, bulk_ptrs[0]);
 				}
 				break;
 			case FREE:
 				if (VERBOSE) {
 					printf("Free request of pointer 0x%08x received.\n", req_in->ptr);
 				}
-				mm_free(req_in->ptr);
+				free_defer(req_in->ptr, 0);
+				shadow_request(FREE, 0, req_in->ptr, 0);
+				break;
+			case FREE_SIZED:
+				if (VERBOSE) {
+					printf("Free request of pointer 0x%08x and size %u received.\n", req_in->ptr, req_in->size);
+				}
+				free_defer(req_in->ptr, req_in->size);
+				shadow_request(FREE, 0, req_in->ptr, 0);
 				break;
 			case REALLOC:
 				if (VERBOSE) {
 					printf("Realloc request of pointer 0x%08x and size %u received.\n", req_in->ptr, req_in->size);
 				}
+				// Freed neighbors let the block grow in place
+				free_flush();
 				ptr = mm_realloc(req_in->ptr, req_in->size);
+				capture_response(ptr);
 				// Return request
-				req_send(&ptr);
+				req_send_response(req_in->id, ptr, mm_usable_size(ptr));
+				shadow_request(REALLOC, req_in->size, req_in->ptr, ptr);
 				if (VERBOSE) {
 					printf("Realloc request finished: %08x\n", ptr);
 				}
 				break;
+			case RESIZE:
+				if (VERBOSE) {
+					printf("Resize of pointer 0x%08x to size %u received.\n", req_in->ptr, req_in->size);
+				}
+				if (!mm_resize(req_in->ptr, req_in->size)) {
+					printf("Resize of 0x%08x to %u is past its usable size\n", req_in->ptr, req_in->size);
+				}
+				// Capture and shadows see a realloc in place
+				capture_response(req_in->ptr);
+				shadow_request(REALLOC, req_in->size, req_in->ptr, req_in->ptr);
+				break;
+			case STATS:
+				// Frees the mcu already made count as free
+				free_flush();
+				mm_stats(&stats);
+				req_send_stats(req_in->id, (uint32_t[CODEC_STATS_WORDS]){stats.live_bytes, stats.free_bytes, stats.largest_free,
+						stats.fragmentation, stats.live_blocks, stats.free_blocks});
+				if (VERBOSE) {
+					printf("Stats: %zu live bytes in %zu blocks, %zu free bytes in %zu blocks, largest %zu\n", stats.live_bytes,
+							stats.live_blocks, stats.free_bytes, stats.free_blocks, stats.largest_free);
+				}
+				break;
+			case MALLOC_USABLE:
+				ptr = mm_usable_size(req_in->ptr) ? req_in->ptr : 0;
+				req_send_response(req_in->id, ptr, mm_usable_size(ptr));
+				break;
 			case SBRK:
 				if (req_in->size) {
 					// Set sbrk
@@ -78,26 +255,41 @@ int main(int argc, char ** argv) {
 						printf("Calling sbrk with %u.\n", req_in->size);
 					}
 					mem_sbrk(req_in->size);
+					shadow_request(SBRK, req_in->size, 0, 0);
 				} else {
 					if (req_in->ptr) {
 						// Reset sbrk
 						if (VERBOSE) {
 							puts("Sbrk reset");
 						}
+						pending_count = 0;
 						mem_reset_brk(req_in->ptr);
 						mm_init(req_in->ptr);
+						mag_init();
+						shadow_request(SBRK, 0, req_in->ptr, 0);
 					} else {
 						// End signal
 						mm_init(0);
 						dict_destroy();
 						puts("Session ended");
+						lat_report();
+						shadow_report();
+						capture_close();
+						req_close();
 						return 0;
 					}
 				}
 				break;
+			case MAG_USED:
+				if (VERBOSE) {
+					printf("Magazine of size %u used %u blocks.\n", req_in->size, req_in->ptr);
+				}
+				mag_used(req_in->size, req_in->ptr);
+				break;
 			default:
 				printf("Invalid request type: %u.\n", req_in->request);
 		}
+		lat_request(req_in->request, start);
 	}
 	return 0;
 }
@@ -0,0 +1,406 @@
+/*
+ * Shadow allocators: the request stream the server handles is replayed into
+ * allocator instances with other fit policies (SHADOW_POLICIES) on a
+ * background thread, to compare heap size, utilization and allocator time
+ * against the policy in use without a second run.
+ * Each shadow owns its heap and extends it itself; the MCU's sbrk requests
+ * only move the server's heap. Shadow blocks are found through the pointer
+ * the server returned for them.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pc_heap.h"
+#include "pc_shadow.h"
+#include "pc_ring.h"
+#include "pc_latency.h"
+#include "../shared_side/shared_config.h"
+
+#define DSIZE 8
+#define CHUNKSIZE (1<<12) // Heap extension, matches the MCU's
+#define MAP_START 1024 // Starting pointer map size, a power of two
+#define POLL_US 50 // Shadow thread sleep when the queue is empty
+
+// Request handled by the server, as queued for the shadow thread
+typedef struct {
+	uint32_t request;
+	uint32_t size;
+	uint32_t ptr;
+	uint32_t response; // Pointer returned, or block count of a grant
+	uint32_t blocks[MAG_BLOCKS]; // Granted blocks
+} shadow_event;
+
+// Request kind of a magazine grant event, after the request types
+#define SHADOW_GRANT (MAG_USED+1)
+
+static const int policies[] = SHADOW_POLICIES;
+#define SHADOW_COUNT (sizeof(policies)/sizeof(policies[0]))
+
+static const char * policy_names[] = {"first_fit", "best_fit", "seg_fit"};
+
+// Live block, keyed by the server's pointer
+typedef struct {
+	uint32_t key; // 0 when the slot is empty
+	uint32_t size; // Requested size
+	uint32_t ptrs[SHADOW_COUNT]; // Block in each shadow heap
+} map_elt;
+
+// Open addressing table of live blocks
+static struct {
+	size_t size;
+	size_t count;
+	map_elt * table;
+} live_map;
+
+// One shadow allocator
+typedef struct {
+	heap_instance heap;
+	uint64_t ops; // Allocator calls made
+	uint64_t time_ns; // Time spent in them
+	size_t peak_heap; // Largest heap over all sessions
+	double util_sum; // Sum of the utilization of each session
+} shadow;
+
+static shadow shadows[SHADOW_COUNT];
+
+// Server heap and payload of the session being mirrored
+static struct {
+	size_t heap; // Sum of the MCU's sbrk requests
+	size_t live; // Requested bytes of live blocks
+	size_t peak_live;
+	size_t peak_heap; // Largest server heap over all sessions
+	double util_sum;
+	size_t sessions;
+} stream;
+
+static ring queue;
+static pthread_t thread;
+static shadow_event grant_event; // Grant being filled in by the server thread
+static uint64_t mirrored = 0; // Events queued
+static uint64_t dropped = 0; // Events lost to a full queue
+static int skipping = 0; // Set after a drop until the next sbrk reset resynchronizes the shadows
+
+// Monotonic time in ns
+static uint64_t now_ns(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Slot holding key, or the empty slot where it belongs
+static map_elt * map_slot(uint32_t key) {
+	size_t index = (key / DSIZE) & (live_map.size-1);
+	while (live_map.table[index].key && live_map.table[index].key != key) {
+		index = (index+1) & (live_map.size-1);
+	}
+	return &(live_map.table[index]);
+}
+
+// Empty the map, allocating it on first use
+static void map_clear(void) {
+	if (!live_map.table) {
+		live_map.size = MAP_START;
+		live_map.table = malloc(live_map.size * sizeof(map_elt));
+	}
+	memset(live_map.table, 0, live_map.size * sizeof(map_elt));
+	live_map.count = 0;
+}
+
+// Double the map once it is half full
+static void map_grow(void) {
+	map_elt * old_table = live_map.table;
+	size_t old_size = live_map.size;
+	live_map.size *= 2;
+	live_map.table = calloc(live_map.size, sizeof(map_elt));
+	for (size_t i=0; i<old_size; i++) {
+		if (old_table[i].key) {
+			*map_slot(old_table[i].key) = old_table[i];
+		}
+	}
+	free(old_table);
+}
+
+// Remove the entry at slot, shifting later entries of its probe run back
+static void map_remove(map_elt * slot) {
+	size_t hole = slot - live_map.table;
+	size_t index = hole;
+	size_t home;
+	live_map.count--;
+	while (1) {
+		index = (index+1) & (live_map.size-1);
+		if (!live_map.table[index].key) {
+			break;
+		}
+		home = (live_map.table[index].key / DSIZE) & (live_map.size-1);
+		// Move the entry unless its home lies cyclically in (hole, index]
+		if (((index - home) & (live_map.size-1)) >= ((index - hole) & (live_map.size-1))) {
+			live_map.table[hole] = live_map.table[index];
+			hole = index;
+		}
+	}
+	live_map.table[hole].key = 0;
+}
+
+// Malloc in the current shadow heap, extending it like the MCU when no block fits
+static uint32_t shadow_malloc(uint32_t size) {
+	uint32_t ptr = mm_malloc(size);
+	size_t asize = DSIZE * ((size + (DSIZE) + (DSIZE-1))/DSIZE);
+	if (!ptr) {
+		mem_sbrk(asize > CHUNKSIZE ? asize : CHUNKSIZE);
+		ptr = mm_malloc(size);
+	}
+	return ptr;
+}
+
+// Fold the session into the totals
+static void session_end(void) {
+	if (!stream.heap) {
+		return;
+	}
+	stream.util_sum += (double)stream.peak_live / stream.heap;
+	if (stream.heap > stream.peak_heap) {
+		stream.peak_heap = stream.heap;
+	}
+	for (size_t i=0; i<SHADOW_COUNT; i++) {
+		cur_heap = &(shadows[i].heap);
+		if (mem_heapsize() > shadows[i].peak_heap) {
+			shadows[i].peak_heap = mem_heapsize();
+		}
+		shadows[i].util_sum += mem_heapsize() ? (double)stream.peak_live / mem_heapsize() : 0;
+	}
+	stream.sessions++;
+}
+
+// Start a session on a heap at ptr
+static void session_reset(uint32_t ptr) {
+	session_end();
+	stream.heap = stream.live = stream.peak_live = 0;
+	map_clear();
+	for (size_t i=0; i<SHADOW_COUNT; i++) {
+		cur_heap = &(shadows[i].heap);
+		if (cur_heap->list_start) {
+			dict_destroy();
+		}
+		mem_reset_brk(ptr);
+		mm_init(ptr);
+	}
+}
+
+// Add a block the server placed at ptr to every shadow
+static void mirror_malloc(uint32_t ptr, uint32_t size) {
+	map_elt * entry;
+	uint64_t start;
+	if (2*(live_map.count+1) > live_map.size) {
+		map_grow();
+	}
+	entry = map_slot(ptr);
+	if (entry->key) {
+		// Server reused a pointer the shadows missed the free of
+		return;
+	}
+	entry->key = ptr;
+	entry->size = size;
+	live_map.count++;
+	for (size_t i=0; i<SHADOW_COUNT; i++) {
+		cur_heap = &(shadows[i].heap);
+		start = now_ns();
+		entry->ptrs[i] = shadow_malloc(size);
+		shadows[i].time_ns += now_ns() - start;
+		shadows[i].ops++;
+	}
+	stream.live += size;
+	if (stream.live > stream.peak_live) {
+		stream.peak_live = stream.live;
+	}
+}
+
+// Free the block the server knows as ptr in every shadow
+static void mirror_free(uint32_t ptr) {
+	map_elt * entry = map_slot(ptr);
+	uint64_t start;
+	if (!entry->key) {
+		return;
+	}
+	for (size_t i=0; i<SHADOW_COUNT; i++) {
+		cur_heap = &(shadows[i].heap);
+		start = now_ns();
+		mm_free(entry->ptrs[i]);
+		shadows[i].time_ns += now_ns() - start;
+		shadows[i].ops++;
+	}
+	stream.live -= entry->size;
+	map_remove(entry);
+}
+
+// Resize a block the server resized in place, shadows that cannot do the same move it
+static void mirror_realloc(uint32_t ptr, uint32_t size) {
+	map_elt * entry = map_slot(ptr);
+	uint32_t new_ptr;
+	uint64_t start;
+	if (!entry->key) {
+		return;
+	}
+	for (size_t i=0; i<SHADOW_COUNT; i++) {
+		cur_heap = &(shadows[i].heap);
+		start = now_ns();
+		if (!(new_ptr = mm_realloc(entry->ptrs[i], size))) {
+			new_ptr = shadow_malloc(size);
+			mm_free(entry->ptrs[i]);
+		}
+		entry->ptrs[i] = new_ptr;
+		shadows[i].time_ns += now_ns() - start;
+		shadows[i].ops++;
+	}
+	stream.live += size - entry->size;
+	entry->size = size;
+	if (stream.live > stream.peak_live) {
+		stream.peak_live = stream.live;
+	}
+}
+
+// Replay one event into the shadows, returns 0 on the end signal
+static int shadow_handle(shadow_event * event) {
+	switch (event->request) {
+		case MALLOC:
+			// Null responses are followed by an sbrk and the same malloc again
+			if (event->response) {
+				mirror_malloc(event->response, event->size);
+			}
+			break;
+		case SHADOW_GRANT:
+			for (size_t i=0; i<event->response; i++) {
+				mirror_malloc(event->blocks[i], event->size);
+			}
+			break;
+		case FREE:
+			mirror_free(event->ptr);
+			break;
+		case REALLOC:
+			// A null response makes the MCU malloc, copy and free, which arrive as their own requests
+			if (event->response) {
+				mirror_realloc(event->ptr, event->size);
+			}
+			break;
+		case SBRK:
+			if (event->size) {
+				stream.heap += event->size;
+			} else if (event->ptr) {
+				session_reset(event->ptr);
+			} else {
+				session_end();
+				return 0;
+			}
+			break;
+	}
+	return 1;
+}
+
+// Shadow thread: replay queued events until the end signal
+static void * shadow_main(void * arg) {
+	shadow_event event;
+	lat_disable();
+	while (1) {
+		if (!ring_pop(&queue, &event)) {
+			usleep(POLL_US);
+			continue;
+		}
+		if (!shadow_handle(&event)) {
+			break;
+		}
+	}
+	// Release the shadow heaps
+	for (size_t i=0; i<SHADOW_COUNT; i++) {
+		cur_heap = &(shadows[i].heap);
+		if (cur_heap->list_start) {
+			mm_init(0);
+			dict_destroy();
+		}
+	}
+	free(live_map.table);
+	return arg;
+}
+
+// Queue event, dropping events from a full queue until the next sbrk reset
+static void shadow_push(shadow_event * event) {
+	int reset = (event->request == SBRK && event->size == 0);
+	if (skipping && !reset) {
+		dropped++;
+		return;
+	}
+	if (reset && !event->ptr) {
+		// End signal, the session is over so waiting is fine
+		while (!ring_push(&queue, event)) {
+			usleep(POLL_US);
+		}
+	} else if (!ring_push(&queue, event)) {
+		dropped++;
+		skipping = 1;
+		return;
+	}
+	skipping = 0;
+	mirrored++;
+}
+
+// Start the shadow allocator thread
+void shadow_start(void) {
+	if (!SHADOWS) {
+		return;
+	}
+	for (size_t i=0; i<SHADOW_COUNT; i++) {
+		shadows[i].heap.search_opt = policies[i];
+	}
+	ring_init(&queue, SHADOW_QUEUE, sizeof(shadow_event));
+	int err = pthread_create(&thread, NULL, shadow_main, NULL);
+	if (err) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(err));
+		exit(1);
+	}
+}
+
+// Mirror a handled request and the pointer returned for it, never blocks
+void shadow_request(uint32_t request, uint32_t size, uint32_t ptr, uint32_t response) {
+	shadow_event event = {.request = request, .size = size, .ptr = ptr, .response = response};
+	if (!SHADOWS) {
+		return;
+	}
+	shadow_push(&event);
+}
+
+// Mirror the magazine grant of count size byte blocks that followed the last malloc response
+void shadow_grant(uint32_t size, uint32_t * blocks, size_t count) {
+	if (!SHADOWS || !count) {
+		return;
+	}
+	grant_event.request = SHADOW_GRANT;
+	grant_event.size = size;
+	grant_event.response = count;
+	memcpy(grant_event.blocks, blocks, count * sizeof(uint32_t));
+	shadow_push(&grant_event);
+}
+
+// Mirror the end signal, wait for the shadows to finish and print the comparison
+void shadow_report(void) {
+	size_t sessions;
+	if (!SHADOWS) {
+		return;
+	}
+	shadow_request(SBRK, 0, 0, 0);
+	pthread_join(thread, NULL);
+	ring_destroy(&queue);
+	sessions = stream.sessions ? stream.sessions : 1;
+	printf("Shadow allocators: %llu requests mirrored", (unsigned long long)mirrored);
+	if (dropped) {
+		printf(", %llu dropped on a full queue, sessions with drops are incomplete", (unsigned long long)dropped);
+	}
+	printf("\n%-10s %12s %8s %10s %8s\n", "policy", "peak heap", "util", "ops", "ns/op");
+	printf("%-10s %12zu %7.1f%% %10s %8s\n", policy_names[SEARCH_OPT], stream.peak_heap, 100*stream.util_sum/sessions, "server", "-");
+	for (size_t i=0; i<SHADOW_COUNT; i++) {
+		printf("%-10s %12zu %7.1f%% %10llu %8llu\n", policy_names[policies[i]], shadows[i].peak_heap,
+				100*shadows[i].util_sum/sessions, (unsigned long long)shadows[i].ops,
+				(unsigned long long)(shadows[i].ops ? shadows[i].time_ns/shadows[i].ops : 0));
+	}
+}
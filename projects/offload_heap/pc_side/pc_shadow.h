@@ -0,0 +1,7 @@
+#include <stdint.h>
+#include <stddef.h>
+
+void shadow_start(void); // Start the shadow allocator thread
+void shadow_request(uint32_t request, uint32_t size, uint32_t ptr, uint32_t response); // Mirror a handled request and its response, never blocks
+void shadow_grant(uint32_t size, uint32_t * blocks, size_t count); // Mirror the magazine grant of the last malloc
+void shadow_report(void); // Mirror the end signal, wait for the thread and print the comparison
@@ -0,0 +1,232 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <linux/serial.h>
+
+#include "pc_transport.h"
+#include "../shared_side/shared_config.h"
+
+static int fd = -1; // Transport file descriptor
+static const transport * active = NULL; // Transport in use
+static int pty_slave = -1; // Slave end held open by the pty transport
+
+// Report the failed call what and exit
+static void fail(const char * what) {
+	perror(what);
+	exit(1);
+}
+
+// Put a terminal into raw mode at BAUDRATE
+static void serial_setup(int fd) {
+	struct termios serial_settings;
+	tcgetattr(fd, &serial_settings);
+
+	// Set buad rate
+	cfsetispeed(&serial_settings, BAUDRATE);
+	cfsetospeed(&serial_settings, BAUDRATE);
+
+	// Set raw mode (no special processing)
+	cfmakeraw(&serial_settings);
+
+	serial_settings.c_cflag &= ~CRTSCTS; // Hardware based flow control off
+	serial_settings.c_cflag |= CREAD | CLOCAL; // Turn on receiver
+
+	// Return as soon as one byte arrives, reads are non-blocking so this only matters for blocking callers
+	serial_settings.c_cc[VMIN] = 1;
+	serial_settings.c_cc[VTIME] = 0;
+	tcflush(fd, TCIOFLUSH); // Clear IO buffer
+	tcsetattr(fd, TCSANOW, &serial_settings); // Apply settings
+}
+
+// Open a serial device
+static int tty_open(const char * dev) {
+	struct serial_struct serial;
+	int tty = open(dev, O_RDWR | O_NOCTTY);
+	if (tty < 0) {
+		// Error when not ran with sudo
+		fail(dev);
+	}
+	serial_setup(tty);
+	// Ask the driver to push received bytes right away (sets the FTDI latency timer to 1 ms)
+	if (ioctl(tty, TIOCGSERIAL, &serial) == 0) {
+		serial.flags |= ASYNC_LOW_LATENCY;
+		ioctl(tty, TIOCSSERIAL, &serial);
+	}
+	return tty;
+}
+
+// Open a pseudo-terminal and link its slave to path for the MCU emulation to open
+static int pty_open(const char * path) {
+	int master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0) {
+		fail("posix_openpt");
+	}
+	if (grantpt(master) || unlockpt(master)) {
+		fail("grantpt");
+	}
+	// Keep the slave open so the master does not see a hangup before the client connects
+	pty_slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+	if (pty_slave < 0) {
+		fail(ptsname(master));
+	}
+	serial_setup(pty_slave);
+	unlink(path);
+	if (symlink(ptsname(master), path)) {
+		fail(path);
+	}
+	printf("Waiting on %s (%s)\n", path, ptsname(master));
+	fflush(stdout);
+	return master;
+}
+
+// Wait for a single client on a listening socket
+static int socket_accept(int server) {
+	if (listen(server, 1)) {
+		fail("listen");
+	}
+	int client = accept(server, NULL, NULL);
+	if (client < 0) {
+		fail("accept");
+	}
+	close(server);
+	return client;
+}
+
+// Listen on a UNIX domain socket at path
+static int unix_open(const char * path) {
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	int server = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (server < 0) {
+		fail("socket");
+	}
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		printf("Socket path %s is too long\n", path);
+		exit(1);
+	}
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	if (bind(server, (struct sockaddr *)&addr, sizeof(addr))) {
+		fail(path);
+	}
+	printf("Waiting on %s\n", path);
+	fflush(stdout);
+	return socket_accept(server);
+}
+
+// Listen on a localhost TCP port
+static int tcp_open(const char * port) {
+	struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(atoi(port)), .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+	int one = 1;
+	int server = socket(AF_INET, SOCK_STREAM, 0);
+	if (server < 0) {
+		fail("socket");
+	}
+	setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(server, (struct sockaddr *)&addr, sizeof(addr))) {
+		fail("bind");
+	}
+	printf("Waiting on 127.0.0.1:%s\n", port);
+	fflush(stdout);
+	int client = socket_accept(server);
+	// Requests are small, send them right away
+	setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return client;
+}
+
+// Available transports
+static const transport transports[] = {
+	{"tty", SERIALDEV, tty_open, 0},
+	{"pty", PTYLINK, pty_open, 0},
+	{"unix", SOCKETPATH, unix_open, 1},
+	{"tcp", TCPPORT, tcp_open, 1},
+};
+
+// Open transport name (tty, pty, unix, tcp), NULL for defaults, returns its non-blocking file descriptor
+int transport_setup(const char * name, const char * arg) {
+	if (!name) {
+		name = TRANSPORT;
+	}
+	for (size_t i=0; i<sizeof(transports)/sizeof(transport); i++) {
+		if (!strcmp(transports[i].name, name)) {
+			active = &(transports[i]);
+		}
+	}
+	if (!active) {
+		printf("Unknown transport %s, use tty, pty, unix or tcp\n", name);
+		exit(1);
+	}
+	if (active->stream) {
+		// A client that hangs up makes writes fail with EPIPE instead of killing the server
+		signal(SIGPIPE, SIG_IGN);
+	}
+	fd = active->open(arg ? arg : active->default_arg);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	return fd;
+}
+
+// Read up to size available bytes without blocking, returns bytes read
+size_t transport_read(size_t size, void * buffer) {
+	ssize_t chunk_read = read(fd, buffer, size);
+	if (chunk_read == 0 && active->stream) {
+		puts("Client disconnected");
+		exit(1);
+	}
+	if (chunk_read < 0) {
+		if (errno != EINTR && errno != EAGAIN) {
+			perror("read");
+			exit(1);
+		}
+		return 0;
+	}
+	return chunk_read;
+}
+
+// Write size bytes, waiting for room when the transport is full
+void transport_write(size_t size, void * buffer) {
+	struct pollfd writable = {.fd = fd, .events = POLLOUT};
+	ssize_t written;
+	while (size) {
+		written = write(fd, buffer, size);
+		if (written < 0 && (errno == EINTR || errno == EAGAIN)) {
+			poll(&writable, 1, -1);
+			continue;
+		}
+		if (written < 0 && errno == EPIPE) {
+			puts("Client disconnected");
+			exit(1);
+		}
+		if (written <= 0) {
+			fail("write");
+		}
+		buffer = (char *)buffer + written;
+		size -= written;
+	}
+}
+
+// Wait up to LINGER ms for the client to hang up so the last response is not lost, then close
+void transport_close(void) {
+	struct pollfd readable = {.fd = fd, .events = POLLIN};
+	char discard[64];
+	if (!active->stream) {
+		tcdrain(fd);
+	}
+	if (pty_slave >= 0) {
+		// Closing the master hangs up the slave and drops unread data
+		close(pty_slave);
+	}
+	while (poll(&readable, 1, LINGER) > 0 && read(fd, discard, sizeof(discard)) > 0);
+	close(fd);
+}
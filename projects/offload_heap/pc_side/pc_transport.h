@@ -0,0 +1,14 @@
+#include <stddef.h>
+
+// Byte stream between the server and the MCU
+typedef struct {
+	const char * name; // Name selecting the transport on the command line
+	const char * default_arg; // Device, path or port used when none is given
+	int (*open)(const char * arg); // Open the transport, returns file descriptor
+	int stream; // 1 when a zero length read means the peer disconnected
+} transport;
+
+int transport_setup(const char * name, const char * arg); // Open transport name (tty, pty, unix, tcp), NULL for defaults, returns non-blocking fd
+size_t transport_read(size_t size, void * buffer); // Read up to size available bytes without blocking, returns bytes read
+void transport_write(size_t size, void * buffer); // Write size bytes, waiting when the transport is full
+void transport_close(void); // Wait for the client to hang up, then close
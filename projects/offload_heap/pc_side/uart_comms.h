@@ -1,10 +1,12 @@
 #include "../shared_side/shared_config.h"
+#include "../shared_side/req_codec.h"
 
 #include <stdint.h>
 
 // MCU to PC request struct
 typedef struct {
-	uint32_t request : 2;
-	uint32_t size : 30;
+	uint32_t request : 4;
+	uint32_t size : 28;
 	uint32_t ptr;
+	uint32_t id; // Request id the response starts with, 0 when the session has none
 } mem_request;
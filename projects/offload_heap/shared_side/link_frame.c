@@ -0,0 +1,40 @@
+/*
+ * link_frame.c - frame format of the link layer shared by the MCU and pc_server
+ *
+ * Each frame starts with FRAME_SYNC so a receiver can resynchronize after
+ * corruption by scanning for the next sync byte. The CRC covers the sequence
+ * byte, the length and the payload.
+ */
+#include "link_frame.h"
+
+// CRC-16/CCITT-FALSE: polynomial 0x1021, initial value 0xFFFF
+uint16_t crc16(const uint8_t * data, size_t len) {
+	uint16_t crc = 0xFFFF;
+	for (size_t i=0; i<len; i++) {
+		crc ^= (uint16_t)data[i] << 8;
+		for (size_t bit=0; bit<8; bit++) {
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+		}
+	}
+	return crc;
+}
+
+// Write a frame carrying len bytes of payload, returns frame length
+size_t frame_build(uint8_t * frame, uint8_t type, uint8_t seq, const void * payload, size_t len) {
+	uint16_t crc;
+	frame[0] = FRAME_SYNC;
+	frame[1] = (type << 6) | (seq & FRAME_SEQ_MASK);
+	frame[2] = len;
+	memcpy(frame+FRAME_HEADER, payload, len);
+	crc = crc16(frame+1, len+FRAME_HEADER-1);
+	frame[FRAME_HEADER+len] = crc & 0xFF;
+	frame[FRAME_HEADER+len+1] = crc >> 8;
+	return len+FRAME_OVERHEAD;
+}
+
+// Returns 1 when the CRC of a complete frame matches its contents
+int frame_check(const uint8_t * frame) {
+	size_t len = FRAME_LEN(frame);
+	uint16_t crc = crc16(frame+1, len+FRAME_HEADER-1);
+	return frame[FRAME_HEADER+len] == (crc & 0xFF) && frame[FRAME_HEADER+len+1] == (crc >> 8);
+}
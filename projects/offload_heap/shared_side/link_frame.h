@@ -0,0 +1,35 @@
+#include "shared_config.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Frame layout: sync, type and sequence number, payload length, payload, CRC-16 (low byte first)
+#define FRAME_SYNC 0x7E
+#define FRAME_HEADER 3
+#define FRAME_OVERHEAD (FRAME_HEADER+2)
+#define FRAME_MAX_PAYLOAD 255
+#define FRAME_MAX (FRAME_MAX_PAYLOAD+FRAME_OVERHEAD)
+
+// Frame types, stored in the top two bits of the sequence byte
+#define FRAME_DATA 0 // Payload in sequence
+#define FRAME_DATA_ACKREQ 1 // Payload in sequence, receiver replies with FRAME_ACK
+#define FRAME_NACK 2 // Resend data frames starting at seq
+#define FRAME_ACK 3 // All data frames before seq received
+
+#define FRAME_SEQ_MASK 0x3F
+#define FRAME_TYPE(frame) ((frame)[1] >> 6)
+#define FRAME_SEQ(frame) ((frame)[1] & FRAME_SEQ_MASK)
+#define FRAME_LEN(frame) ((frame)[2])
+
+// Distance from expected to seq, values past half the sequence space are old frames
+#define SEQ_DIFF(seq, expected) (((seq) - (expected)) & FRAME_SEQ_MASK)
+#define SEQ_OLD(seq, expected) (SEQ_DIFF(seq, expected) > FRAME_SEQ_MASK/2)
+
+// Frame receive results
+#define FRAME_OK 0
+#define FRAME_TIMEOUT 1
+#define FRAME_CORRUPT 2
+
+uint16_t crc16(const uint8_t * data, size_t len); // CRC-16/CCITT-FALSE of len bytes
+size_t frame_build(uint8_t * frame, uint8_t type, uint8_t seq, const void * payload, size_t len); // Write frame, returns frame length
+int frame_check(const uint8_t * frame); // Returns 1 when the complete frame's CRC matches
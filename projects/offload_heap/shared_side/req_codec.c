@@ -0,0 +1,381 @@
+/*
+ * req_codec.c - request and response wire encoding shared by the MCU and pc_server
+ *
+ * Fixed encoding: request is a little endian word of request | size << 4 followed
+ * by the pointer word, responses are one little endian word.
+ *
+ * Compact encoding: request is a one byte opcode followed by varint fields.
+ * Sizes are in WIRE_ALIGN units and pointers are WIRE_ALIGN unit offsets from the
+ * heap start plus one, so NULL encodes as 0. Response pointers keep their low flag
+ * bits below the offset.
+ *
+ * HELLO: request and response both use two little endian words, the first with
+ * HELLO in the low 4 bits (so it reads as a fixed encoding request), then the
+ * version, batch and frame fields, the second with the capability bits. A compact
+ * opcode never has HELLO in its low 4 bits, so the server can tell a HELLO from
+ * the sbrk reset older firmware starts with.
+ *
+ * Request ids: once negotiated, malloc and realloc requests carry an id, a varint
+ * after the opcode or a third word in the fixed encoding. Their response starts
+ * with the id as a response count word.
+ *
+ * Bulk malloc: MALLOC_BULK carries the block count as its size (not in WIRE_ALIGN
+ * units) and is followed by that many sizes, each a varint in WIRE_ALIGN units or
+ * a word in the fixed encoding. The response is the id and one pointer per size.
+ *
+ * Usable size: once negotiated, a non-NULL malloc, realloc or memalign response
+ * pointer is followed by the block's usable size, encoded like a bulk size (before
+ * the grant count of a magazine grant). MALLOC_USABLE carries an id and a pointer,
+ * RESIZE is encoded like a realloc without an id.
+ *
+ * Sized free: FREE_SIZED is encoded like a realloc without an id.
+ *
+ * Stats: STATS carries only an id. The response is the id and CODEC_STATS_WORDS
+ * response counts: live bytes, free bytes, largest free block, fragmentation in
+ * 1/1000, allocated blocks and free blocks.
+ */
+#include "req_codec.h"
+
+#define FLAG_BITS 3 // Low pointer bits free for response flags
+#define FLAG_MASK ((1U << FLAG_BITS)-1)
+
+// The pc server decodes and encodes on different threads, each follows the session in its own copy
+#ifdef __linux__
+#define CODEC_STATE _Thread_local
+#else
+#define CODEC_STATE
+#endif
+
+static CODEC_STATE int compact = COMPACT_ENCODING;
+static CODEC_STATE int ids = 0;
+static CODEC_STATE uint32_t heap_base = 0;
+
+// Write value as a little endian word
+static size_t fixed_encode(uint8_t * buf, uint32_t value) {
+	for (size_t i=0; i<4; i++) {
+		buf[i] = value >> (8*i);
+	}
+	return 4;
+}
+
+// Read a little endian word
+static uint32_t fixed_decode(const uint8_t * buf) {
+	uint32_t value = 0;
+	for (size_t i=0; i<4; i++) {
+		value |= (uint32_t)buf[i] << (8*i);
+	}
+	return value;
+}
+
+// Write value as LEB128 varint, 7 bits per byte with continuation in the top bit
+static size_t varint_encode(uint8_t * buf, uint32_t value) {
+	size_t len = 0;
+	while (value >= 0x80) {
+		buf[len++] = (value & 0x7F) | 0x80;
+		value >>= 7;
+	}
+	buf[len++] = value;
+	return len;
+}
+
+// Read varint from at most len bytes, returns bytes used or 0 if incomplete
+static size_t varint_decode(const uint8_t * buf, size_t len, uint32_t * value) {
+	*value = 0;
+	for (size_t i=0; i<len && i<CODEC_MAX_WORD; i++) {
+		*value |= (uint32_t)(buf[i] & 0x7F) << (7*i);
+		if (!(buf[i] & 0x80)) {
+			return i+1;
+		}
+	}
+	return 0;
+}
+
+// Heap pointer to unit offset plus one, 0 for NULL
+static uint32_t ptr_to_units(uint32_t ptr) {
+	return ptr ? ((ptr - heap_base)/WIRE_ALIGN + 1) : 0;
+}
+
+// Unit offset plus one back to heap pointer
+static uint32_t units_to_ptr(uint32_t units) {
+	return units ? (heap_base + (units-1)*WIRE_ALIGN) : 0;
+}
+
+// Select compact (1) or fixed (0) encoding
+void codec_set_compact(int c) {
+	compact = c;
+}
+
+// Returns 1 when the compact encoding is in use
+int codec_get_compact(void) {
+	return compact;
+}
+
+// Send request ids with malloc and realloc (1) or not (0)
+void codec_set_ids(int i) {
+	ids = i;
+}
+
+// Returns 1 when requests carry ids
+int codec_get_ids(void) {
+	return ids;
+}
+
+// Returns 1 when request carries an id
+static int has_id(uint32_t request) {
+	return ids && (request == MALLOC || request == REALLOC || request == MALLOC_BULK || request == MEMALIGN || request == MALLOC_USABLE ||
+			request == STATS);
+}
+
+// Set heap start that compact pointers are relative to
+void codec_set_base(uint32_t base) {
+	heap_base = base;
+}
+
+// Size the server sees for a request of size bytes
+uint32_t codec_size(uint32_t size) {
+	if (compact) {
+		return ((size + WIRE_ALIGN-1)/WIRE_ALIGN)*WIRE_ALIGN;
+	}
+	return size;
+}
+
+// Encode request into buf, returns length
+size_t codec_req_encode(uint8_t * buf, uint32_t request, uint32_t size, uint32_t ptr, uint32_t id) {
+	size_t len;
+	if (!compact) {
+		len = fixed_encode(buf, request | (size << 4));
+		len += fixed_encode(buf+len, ptr);
+		if (has_id(request)) {
+			len += fixed_encode(buf+len, id);
+		}
+		return len;
+	}
+
+	buf[0] = request;
+	len = 1;
+	if (has_id(request)) {
+		len += varint_encode(buf+len, id);
+	}
+	switch (request) {
+		case MALLOC:
+			len += varint_encode(buf+len, (size + WIRE_ALIGN-1)/WIRE_ALIGN);
+			break;
+		case FREE:
+		case MALLOC_USABLE:
+			len += varint_encode(buf+len, ptr_to_units(ptr));
+			break;
+		case REALLOC:
+		case RESIZE:
+		case FREE_SIZED:
+			len += varint_encode(buf+len, ptr_to_units(ptr));
+			len += varint_encode(buf+len, (size + WIRE_ALIGN-1)/WIRE_ALIGN);
+			break;
+		case SBRK:
+			// Sbrk increments in bytes, reset and end carry the absolute heap start
+			len += varint_encode(buf+len, size);
+			if (size == 0) {
+				len += fixed_encode(buf+len, ptr);
+			}
+			break;
+		case MAG_USED:
+			len += varint_encode(buf+len, (size + WIRE_ALIGN-1)/WIRE_ALIGN);
+			len += varint_encode(buf+len, ptr);
+			break;
+		case MALLOC_BULK:
+			len += varint_encode(buf+len, size);
+			break;
+		case MEMALIGN:
+			// Alignment in bytes
+			len += varint_encode(buf+len, (size + WIRE_ALIGN-1)/WIRE_ALIGN);
+			len += varint_encode(buf+len, ptr);
+			break;
+		default:
+			break;
+	}
+	return len;
+}
+
+// Decode request from len bytes of buf, returns bytes used or 0 if incomplete
+size_t codec_req_decode(const uint8_t * buf, size_t len, uint32_t * request, uint32_t * size, uint32_t * ptr, uint32_t * id) {
+	size_t used = 1;
+	size_t n;
+	uint32_t value;
+
+	*id = 0;
+	if (!compact) {
+		if (len < 8) {
+			return 0;
+		}
+		value = fixed_decode(buf);
+		*request = value & 0xF;
+		*size = value >> 4;
+		*ptr = fixed_decode(buf+4);
+		if (has_id(*request)) {
+			if (len < 12) {
+				return 0;
+			}
+			*id = fixed_decode(buf+8);
+			return 12;
+		}
+		return 8;
+	}
+
+	if (len < 1) {
+		return 0;
+	}
+	*request = buf[0];
+	*size = 0;
+	*ptr = 0;
+	if (has_id(*request)) {
+		if (!(n = varint_decode(buf+used, len-used, id))) return 0;
+		used += n;
+	}
+	switch (*request) {
+		case MALLOC:
+			if (!(n = varint_decode(buf+used, len-used, &value))) return 0;
+			*size = value*WIRE_ALIGN;
+			used += n;
+			break;
+		case FREE:
+		case MALLOC_USABLE:
+			if (!(n = varint_decode(buf+used, len-used, &value))) return 0;
+			*ptr = units_to_ptr(value);
+			used += n;
+			break;
+		case REALLOC:
+		case RESIZE:
+		case FREE_SIZED:
+			if (!(n = varint_decode(buf+used, len-used, &value))) return 0;
+			*ptr = units_to_ptr(value);
+			used += n;
+			if (!(n = varint_decode(buf+used, len-used, &value))) return 0;
+			*size = value*WIRE_ALIGN;
+			used += n;
+			break;
+		case SBRK:
+			if (!(n = varint_decode(buf+used, len-used, size))) return 0;
+			used += n;
+			if (*size == 0) {
+				if (len-used < 4) return 0;
+				*ptr = fixed_decode(buf+used);
+				used += 4;
+			}
+			break;
+		case MAG_USED:
+			if (!(n = varint_decode(buf+used, len-used, &value))) return 0;
+			*size = value*WIRE_ALIGN;
+			used += n;
+			if (!(n = varint_decode(buf+used, len-used, ptr))) return 0;
+			used += n;
+			break;
+		case MALLOC_BULK:
+			if (!(n = varint_decode(buf+used, len-used, size))) return 0;
+			used += n;
+			break;
+		case MEMALIGN:
+			if (!(n = varint_decode(buf+used, len-used, &value))) return 0;
+			*size = value*WIRE_ALIGN;
+			used += n;
+			if (!(n = varint_decode(buf+used, len-used, ptr))) return 0;
+			used += n;
+			break;
+		default:
+			break;
+	}
+	return used;
+}
+
+// Encode a size following a bulk request
+size_t codec_size_encode(uint8_t * buf, uint32_t size) {
+	if (!compact) {
+		return fixed_encode(buf, size);
+	}
+	return varint_encode(buf, (size + WIRE_ALIGN-1)/WIRE_ALIGN);
+}
+
+// Decode a bulk size from len bytes of buf, returns bytes used or 0 if incomplete
+size_t codec_size_decode(const uint8_t * buf, size_t len, uint32_t * size) {
+	size_t used;
+	if (!compact) {
+		if (len < 4) {
+			return 0;
+		}
+		*size = fixed_decode(buf);
+		return 4;
+	}
+	if ((used = varint_decode(buf, len, size))) {
+		*size *= WIRE_ALIGN;
+	}
+	return used;
+}
+
+// Encode response pointer, low FLAG_BITS carry response flags
+size_t codec_ptr_encode(uint8_t * buf, uint32_t ptr) {
+	if (!compact) {
+		return fixed_encode(buf, ptr);
+	}
+	if (ptr == 0) {
+		return varint_encode(buf, 0);
+	}
+	return varint_encode(buf, (ptr_to_units(ptr & ~FLAG_MASK) << FLAG_BITS) | (ptr & FLAG_MASK));
+}
+
+// Decode complete response pointer with its flag bits
+uint32_t codec_ptr_decode(const uint8_t * buf) {
+	uint32_t value;
+	if (!compact) {
+		return fixed_decode(buf);
+	}
+	varint_decode(buf, CODEC_MAX_WORD, &value);
+	if (value == 0) {
+		return 0;
+	}
+	return units_to_ptr(value >> FLAG_BITS) | (value & FLAG_MASK);
+}
+
+// Encode response count
+size_t codec_uint_encode(uint8_t * buf, uint32_t value) {
+	return compact ? varint_encode(buf, value) : fixed_encode(buf, value);
+}
+
+// Decode complete response count
+uint32_t codec_uint_decode(const uint8_t * buf) {
+	uint32_t value;
+	if (!compact) {
+		return fixed_decode(buf);
+	}
+	varint_decode(buf, CODEC_MAX_WORD, &value);
+	return value;
+}
+
+// Encode HELLO request or response, returns its length
+size_t codec_hello_encode(uint8_t * buf, const codec_hello * hello) {
+	uint32_t fields = HELLO | (hello->version & 0xFF) << 4 | (hello->batch & 0xFF) << 12 | (hello->frame & 0xFFF) << 20;
+	size_t len = fixed_encode(buf, fields);
+	return len + fixed_encode(buf+len, hello->caps);
+}
+
+// Decode a complete HELLO
+void codec_hello_decode(const uint8_t * buf, codec_hello * hello) {
+	uint32_t fields = fixed_decode(buf);
+	hello->version = (fields >> 4) & 0xFF;
+	hello->batch = (fields >> 12) & 0xFF;
+	hello->frame = fields >> 20;
+	hello->caps = fixed_decode(buf+4);
+}
+
+// Returns 1 when the request starting with byte buf[0] is a HELLO
+int codec_is_hello(const uint8_t * buf) {
+	return (buf[0] & 0xF) == HELLO;
+}
+
+// Bytes still needed to complete the response word in buf, 0 when complete
+size_t codec_word_need(const uint8_t * buf, size_t len) {
+	if (!compact) {
+		return 4 - len;
+	}
+	if (len == 0 || ((buf[len-1] & 0x80) && len < CODEC_MAX_WORD)) {
+		return 1;
+	}
+	return 0;
+}
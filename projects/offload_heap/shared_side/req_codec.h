@@ -0,0 +1,51 @@
+#include "shared_config.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Largest encoded request and word, in bytes
+#define CODEC_MAX_REQ 16 // opcode, request id and two 5 byte varints
+#define CODEC_MAX_WORD 5 // one varint
+#define CODEC_HELLO_SIZE 8 // HELLO request or response, same fixed layout in every encoding
+#define CODEC_STATS_WORDS 6 // Counts in a STATS response
+
+// Protocol version sent in HELLO, firmware without HELLO is version 0
+#define PROTOCOL_VERSION 1
+
+// HELLO capability bits
+#define CAP_COMPACT 0x1 // Compact encoding after the exchange
+#define CAP_MAGAZINES 0x2 // Malloc responses may carry magazine grants
+#define CAP_REQ_ID 0x4 // Malloc and realloc requests carry an id that their response starts with
+#define CAP_BULK 0x8 // MALLOC_BULK requests are understood
+#define CAP_MEMALIGN 0x10 // MEMALIGN requests are understood
+#define CAP_USABLE 0x20 // Malloc, realloc and memalign responses carry the usable size, RESIZE and MALLOC_USABLE are understood
+#define CAP_SIZED_FREE 0x40 // FREE_SIZED requests are understood
+#define CAP_STATS 0x80 // STATS requests are understood
+
+// Session parameters offered by the MCU in HELLO and agreed on by the server in its response
+typedef struct {
+	uint32_t version; // Protocol version, up to 255
+	uint32_t batch; // Most requests sent in one transfer, up to 255
+	uint32_t frame; // Largest frame payload accepted, up to FRAME_MAX_PAYLOAD (255) although HELLO has room for 4095
+	uint32_t caps; // CAP_ bits
+} codec_hello;
+
+void codec_set_compact(int compact); // Select compact (1) or fixed 8/4 byte (0) encoding
+int codec_get_compact(void); // Returns 1 when the compact encoding is in use
+void codec_set_ids(int ids); // Send request ids with malloc and realloc (1) or not (0)
+int codec_get_ids(void); // Returns 1 when requests carry ids
+void codec_set_base(uint32_t base); // Set heap start that compact pointers are relative to
+uint32_t codec_size(uint32_t size); // Request size as seen by the server after encoding
+
+size_t codec_req_encode(uint8_t * buf, uint32_t request, uint32_t size, uint32_t ptr, uint32_t id); // Encode request into buf, returns length
+size_t codec_req_decode(const uint8_t * buf, size_t len, uint32_t * request, uint32_t * size, uint32_t * ptr, uint32_t * id); // Decode request, returns length used or 0 if incomplete
+size_t codec_size_encode(uint8_t * buf, uint32_t size); // Encode a size following a bulk request, returns length
+size_t codec_size_decode(const uint8_t * buf, size_t len, uint32_t * size); // Decode a bulk size, returns length used or 0 if incomplete
+size_t codec_ptr_encode(uint8_t * buf, uint32_t ptr); // Encode response pointer with flag bits, returns length
+uint32_t codec_ptr_decode(const uint8_t * buf); // Decode a complete response pointer
+size_t codec_uint_encode(uint8_t * buf, uint32_t value); // Encode response count, returns length
+uint32_t codec_uint_decode(const uint8_t * buf); // Decode a complete response count
+size_t codec_hello_encode(uint8_t * buf, const codec_hello * hello); // Encode HELLO request or response, returns CODEC_HELLO_SIZE
+void codec_hello_decode(const uint8_t * buf, codec_hello * hello); // Decode a complete HELLO
+int codec_is_hello(const uint8_t * buf); // Returns 1 when the first request byte starts a HELLO, in either encoding
+size_t codec_word_need(const uint8_t * buf, size_t len); // Bytes still needed to complete the word in buf, 0 when complete
@@ -1,9 +1,49 @@
 #define BAUDRATE B4000000 // The USARTDIV bits for the MCU needs to be manually calculated and set in mcu_side/uart.c
 #define BUFFERSIZE 2048 // Max message size, should not exceed 4095 due to termios restrictions
 #define SERIALDEV "/dev/ttyUSB0" // UART device name
+#define TRANSPORT "tty" // Default pc_server transport: tty, pty, unix or tcp
+#define PTYLINK "/tmp/offload_heap.pty" // Symlink to the pty slave created by the pty transport
+#define SOCKETPATH "/tmp/offload_heap.sock" // UNIX socket path for the unix transport
+#define TCPPORT "5555" // Localhost port for the tcp transport
+#define LINGER 100 // ms pc_server waits at session end for the client to read the last response
 #define USE_DMA 1 // Whether or not to use DMA for UART
+#define TX_RING 512 // Bytes the MCU can queue for DMA transmission (power of 2), sends only wait when it is full
+#define RX_RING 512 // Bytes circular DMA reception buffers on the MCU (power of 2), older unread bytes are lost once it laps
 #define VERBOSE 0 // Whether or not to print debug message in pc_server
+#define PIPELINE 1 // 1 to read, decode and send on an I/O thread that feeds pc_server's allocator thread through lock-free queues
+#define LATENCY_STATS 1 // 1 to record pc_server latency histograms and report them at session end
+#define LATENCY_FILE "latency.csv" // Machine-readable latency report written by pc_server
+#define CAPTURE_REQUESTS 0 // 1 to log every request and response pc_server handles to CAPTURE_FILE
+#define CAPTURE_FILE "capture.bin" // Binary request capture, convert with capture_to_rep.py
+#define SHADOWS 0 // 1 to replay requests into shadow allocators on a background thread and compare them at session end
+#define SHADOW_POLICIES {FIRST_FIT, BEST_FIT} // Fit policy of each shadow allocator
+#define SHADOW_QUEUE 4096 // Requests buffered for the shadow thread (power of 2), a full queue drops them
 #define DICT_SEARCH 1 // 0 to use linear pointer search, 1 to use hashtable
+#define LINK_FRAMING 1 // 1 to send messages in frames with sequence number and CRC-16, retransmitting on errors
+#define LINK_WINDOW 4 // Sent frames kept for retransmission (power of 2 up to 32), MCU waits for an ack once the window is full
+#define LINK_TIMEOUT 20 // Time in ms the MCU waits for a frame before retransmitting
+#define LINK_RETRIES 10 // Retransmissions before the MCU gives up on the link
+#define COMPACT_ENCODING 1 // 1 for opcode and varint request encoding, 0 for fixed 8 byte requests and 4 byte responses
+#define WIRE_ALIGN 8 // Size and pointer unit of the compact encoding, matches server block alignment
+#define FREE_QUEUE_SIZE 16 // Number of frees the MCU batches into one transfer, 0 to send each free immediately
+#define REQ_SLOTS 4 // Malloc and realloc requests the MCU can keep in flight, above 1 their responses are matched by request id
+#define ASYNC_HANDLES 8 // Async mallocs and reallocs the MCU tracks at once, REQ_SLOTS of them can wait for the server
+#define BULK_MAX 32 // Most blocks in one bulk malloc request, larger bulks are split
+#define USABLE_TABLE 64 // Usable sizes the MCU remembers (power of 2) to answer reallocs within them locally, 0 to ask the server
+#define LOCAL_HEAP 0 // Bytes of an on-chip region the MCU manages itself for small blocks and interrupt handlers, 0 to offload every block
+#define LOCAL_MAX 32 // Mallocs up to this many bytes go to the local region while it has room, every malloc does once the link is lost
+#define ISR_POOL_SIZES {32, 128} // Block sizes of the interrupt handler pools, smallest first
+#define ISR_POOL_BLOCKS 0 // Blocks each interrupt handler pool keeps ready, 0 for no pools
+#define ISR_FREE_QUEUE 16 // Frees from interrupt handlers that can wait for the next flush
+#define DMA_COPY_MIN 256 // Realloc moves of at least this many bytes are copied by DMA2 while the free is sent, 0 to always use memcpy
+#define DEFER_FREES 64 // Frees pc_server holds back and applies sorted by address when idle or out of space, 0 to free on receipt
+
+// Magazine options: server pre-allocates blocks of frequently requested sizes to the MCU
+#define MAGAZINES 1 // 1 to enable magazines, 0 to send every malloc to the server
+#define MAG_CLASSES 4 // Request sizes that can hold magazines at once
+#define MAG_BLOCKS 8 // Blocks per magazine grant
+#define MAG_THRESHOLD 16 // Mallocs of a size seen before it is granted magazines
+#define MAG_MAX_SIZE 256 // Largest request size granted magazines
 
 // Free block search options
 #define FIRST_FIT 0
@@ -21,3 +61,14 @@
 #define FREE 1
 #define REALLOC 2
 #define SBRK 3
+#define MAG_USED 4
+#define HELLO 5 // Optional first request of a session, negotiates protocol options (see req_codec.c)
+#define MALLOC_BULK 6 // Malloc of several sizes answered in one response, the sizes follow the request
+#define MEMALIGN 7 // Malloc with the alignment (a power of 2) as ptr
+#define MALLOC_USABLE 8 // Usable size query of ptr, answered like a malloc that returned ptr
+#define RESIZE 9 // Realloc the MCU answered itself within the usable size, no response
+#define FREE_SIZED 10 // Free with the size the MCU allocated, checked against the block
+#define STATS 11 // Heap statistics query, answered with CODEC_STATS_WORDS counts
+
+// Malloc response flag, set when a magazine grant follows the pointer
+#define GRANT_FLAG 0x1